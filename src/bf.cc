@@ -1,10 +1,16 @@
 import <fstream>;
 import <iostream>;
+import <map>;
+import <optional>;
 import <span>;
 import <unordered_map>;
 import <vector>;
 
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
 
 enum opcode {
   add,  // arg is how much to add.
@@ -14,16 +20,24 @@ enum opcode {
   jump_if_zero,  // arg is a relative offset.
   jump_unless_zero,  // arg is a relative offset.
   halt,  // arg is unused.
+  set_zero,  // arg is unused.
+  mul_add,  // arg is the offset of the target cell, factor the multiplier.
+  scan,  // arg is the stride.
   invalid,  // cannot be executed.
 };
 
 template <typename Tag>
 struct op {
-  unsigned short code : 3;
-  short arg : 13;
+  constexpr op(unsigned code = invalid, int arg = 0, int factor = 0)
+      : code(code), factor(factor), arg(arg) {}
+
+  unsigned short code : 4;
+  short factor : 12;
+  short arg;
 };
-static_assert(sizeof(op<int>) == 2);
+static_assert(sizeof(op<int>) == 4);
 static_assert(op<int>{0, -1}.arg == -1);
+static_assert(op<int>{mul_add, 1, -2}.factor == -2);
 
 // op<jump_id> has ids for jumps rather than relative offsets.
 struct jump_id {};
@@ -97,6 +111,64 @@ std::vector<op<jump_id>> combine(std::span<const op<jump_id>> input) {
   return output;
 }
 
+// Rewrite the body of an innermost loop, which only contains add and move, as
+// straight-line code, if it is one of the common idioms:
+//   [-]          set_zero
+//   [->+>++<<]   mul_add(1, 1), mul_add(2, 2), set_zero
+//   [>>]         scan(2)
+std::optional<std::vector<op<jump_id>>> simplify_loop(
+    std::span<const op<jump_id>> body) {
+  if (body.size() == 1 && body[0].code == move) {
+    return std::vector<op<jump_id>>{{scan, body[0].arg}};
+  }
+  int offset = 0;
+  std::map<int, int> deltas;
+  for (auto in : body) {
+    if (in.code == move) {
+      offset += in.arg;
+    } else {
+      deltas[offset] += in.arg;
+    }
+  }
+  // The loop must return to the cell it tests, and must count it down by
+  // exactly one per iteration (or up by one, if it does nothing else).
+  if (offset != 0) return std::nullopt;
+  const int step = deltas[0];
+  deltas.erase(0);
+  std::erase_if(deltas, [](auto d) { return d.second == 0; });
+  if (step != -1 && !(step == 1 && deltas.empty())) return std::nullopt;
+  std::vector<op<jump_id>> output;
+  for (auto [offset, factor] : deltas) {
+    const op<jump_id> out{mul_add, offset, factor};
+    if (out.arg != offset || out.factor != factor) return std::nullopt;
+    output.push_back(out);
+  }
+  output.push_back({set_zero});
+  return output;
+}
+
+std::vector<op<jump_id>> simplify_loops(std::span<const op<jump_id>> input) {
+  std::vector<op<jump_id>> output;
+  for (int i = 0, n = input.size(); i < n; i++) {
+    if (input[i].code == jump_if_zero) {
+      // If the loop contains nothing but add and move, this must be its end.
+      int end = i + 1;
+      while (end < n && (input[end].code == add || input[end].code == move)) {
+        end++;
+      }
+      if (end < n && input[end].code == jump_unless_zero) {
+        if (auto loop = simplify_loop(input.subspan(i + 1, end - i - 1))) {
+          output.insert(output.end(), loop->begin(), loop->end());
+          i = end;
+          continue;
+        }
+      }
+    }
+    output.push_back(input[i]);
+  }
+  return output;
+}
+
 // op<jump_relative> has relative offsets for jumps.
 struct jump_relative {};
 std::vector<op<jump_relative>> link_jumps(std::span<const op<jump_id>> input) {
@@ -110,8 +182,7 @@ std::vector<op<jump_relative>> link_jumps(std::span<const op<jump_id>> input) {
   }
   std::vector<op<jump_relative>> output;
   for (auto in : input) {
-    op<jump_relative> out;
-    out.code = in.code;
+    op<jump_relative> out{in.code, in.arg, in.factor};
     switch (in.code) {
       case jump_if_zero:
         out.arg = loop_end.at(in.arg) - loop_start.at(in.arg);
@@ -119,15 +190,162 @@ std::vector<op<jump_relative>> link_jumps(std::span<const op<jump_id>> input) {
       case jump_unless_zero:
         out.arg = loop_start.at(in.arg) - loop_end.at(in.arg);
         break;
-      default: out.arg = in.arg; break;
     }
     output.push_back(out);
   }
   return output;
 }
 
+// Equivalent to: while (cells[di] != 0) di += stride;
+int find_zero(std::span<const int> cells, int di, int stride) {
+  const int n = cells.size();
+  constexpr int block = 16;
+  // For unit strides, test a whole block at a time. The inner loops have no
+  // early exit, so the comparisons can be vectorized.
+  if (stride == 1) {
+    for (; di + block <= n; di += block) {
+      bool found = false;
+      for (int i = 0; i < block; i++) found |= cells[di + i] == 0;
+      if (found) break;
+    }
+  } else if (stride == -1) {
+    for (; di - block + 1 >= 0; di -= block) {
+      bool found = false;
+      for (int i = 0; i < block; i++) found |= cells[di - i] == 0;
+      if (found) break;
+    }
+  }
+  while (0 <= di && di < n && cells[di] != 0) di += stride;
+  return di;
+}
+
+constexpr int num_cells = 16384;
+
+int read_cell() { return std::cin.get(); }
+void write_cell(int value) { std::cout.put(value); }
+int scan_cells(int* cells, int di, int stride) {
+  return find_zero({cells, num_cells}, di, stride);
+}
+
+// The program compiled to x86-64 code. Register use:
+//   rbx  pointer to the current cell
+//   r12  pointer to the first cell
+// Unlike run(), the compiled code does not check that the pointer stays on the
+// tape.
+class compiled_program {
+ public:
+  explicit compiled_program(std::span<const op<jump_relative>> program) {
+    // push rbp; push rbx; push r12; mov rbx, rdi; mov r12, rdi
+    emit({0x55, 0x53, 0x41, 0x54, 0x48, 0x89, 0xfb, 0x49, 0x89, 0xfc});
+    std::vector<int> offsets;  // Code offset of each op.
+    std::vector<std::pair<int, int>> jumps;  // (rel32 offset, target op).
+    for (int i = 0, n = program.size(); i < n; i++) {
+      const auto op = program[i];
+      offsets.push_back(code_.size());
+      switch (op.code) {
+        case add:  // add dword [rbx], arg
+          emit({0x81, 0x03});
+          emit32(op.arg);
+          break;
+        case move:  // add rbx, 4 * arg
+          emit({0x48, 0x81, 0xc3});
+          emit32(4 * op.arg);
+          break;
+        case in:
+          call(read_cell);
+          emit({0x89, 0x03});  // mov [rbx], eax
+          break;
+        case out:
+          emit({0x8b, 0x3b});  // mov edi, [rbx]
+          call(write_cell);
+          break;
+        case jump_if_zero:
+        case jump_unless_zero:
+          // cmp dword [rbx], 0; je/jne rel32
+          emit({0x83, 0x3b, 0x00, 0x0f});
+          code_.push_back(op.code == jump_if_zero ? 0x84 : 0x85);
+          jumps.emplace_back(code_.size(), i + op.arg + 1);
+          emit32(0);
+          break;
+        case set_zero:  // mov dword [rbx], 0
+          emit({0xc7, 0x03});
+          emit32(0);
+          break;
+        case mul_add:
+          // mov eax, [rbx]; imul eax, eax, factor; add [rbx + 4 * arg], eax
+          emit({0x8b, 0x03, 0x69, 0xc0});
+          emit32(op.factor);
+          emit({0x01, 0x83});
+          emit32(4 * op.arg);
+          break;
+        case scan:
+          // mov rdi, r12; mov rsi, rbx; sub rsi, r12; sar rsi, 2; mov edx, arg
+          emit({0x4c, 0x89, 0xe7, 0x48, 0x89, 0xde, 0x4c, 0x29, 0xe6, 0x48,
+                0xc1, 0xfe, 0x02, 0xba});
+          emit32(op.arg);
+          call(scan_cells);
+          // movsxd rax, eax; lea rbx, [r12 + 4 * rax]
+          emit({0x48, 0x63, 0xc0, 0x49, 0x8d, 0x1c, 0x84});
+          break;
+        case halt:  // pop r12; pop rbx; pop rbp; ret
+          emit({0x41, 0x5c, 0x5b, 0x5d, 0xc3});
+          break;
+      }
+    }
+    for (auto [offset, target] : jumps) {
+      const std::int32_t relative = offsets[target] - (offset + 4);
+      std::memcpy(code_.data() + offset, &relative, 4);
+    }
+    // Copy the code into executable memory.
+    size_ = code_.size();
+    void* memory = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      std::perror("mmap");
+      std::exit(1);
+    }
+    std::memcpy(memory, code_.data(), size_);
+    if (mprotect(memory, size_, PROT_READ | PROT_EXEC) != 0) {
+      std::perror("mprotect");
+      std::exit(1);
+    }
+    entry_ = reinterpret_cast<void (*)(int*)>(memory);
+  }
+
+  ~compiled_program() { munmap(reinterpret_cast<void*>(entry_), size_); }
+
+  compiled_program(const compiled_program&) = delete;
+  compiled_program& operator=(const compiled_program&) = delete;
+
+  void operator()(int* cells) const { entry_(cells); }
+
+ private:
+  void emit(std::initializer_list<unsigned char> bytes) {
+    code_.insert(code_.end(), bytes);
+  }
+
+  void emit32(std::int32_t value) {
+    unsigned char bytes[4];
+    std::memcpy(bytes, &value, 4);
+    code_.insert(code_.end(), bytes, bytes + 4);
+  }
+
+  // The stack is 16-byte aligned after the three pushes on entry.
+  template <typename F>
+  void call(F* function) {
+    // movabs rax, function; call rax
+    emit({0x48, 0xb8});
+    const auto address = reinterpret_cast<std::uint64_t>(function);
+    for (int i = 0; i < 8; i++) code_.push_back(address >> (8 * i));
+    emit({0xff, 0xd0});
+  }
+
+  std::vector<unsigned char> code_;
+  std::size_t size_;
+  void (*entry_)(int*);
+};
+
 void run(std::span<const op<jump_relative>> program) {
-  constexpr int num_cells = 16384;
   int cells[num_cells];
   int di = 0;
   int pc = 0;
@@ -153,6 +371,17 @@ void run(std::span<const op<jump_relative>> program) {
       case jump_unless_zero:
         if (cells[di] != 0) pc += op.arg;
         break;
+      case set_zero:
+        cells[di] = 0;
+        break;
+      case mul_add:
+        assert(0 <= di + op.arg && di + op.arg < num_cells);
+        cells[di + op.arg] += cells[di] * op.factor;
+        break;
+      case scan:
+        di = find_zero(cells, di, op.arg);
+        assert(0 <= di && di < num_cells);
+        break;
       case halt:
         return;
     }
@@ -160,12 +389,23 @@ void run(std::span<const op<jump_relative>> program) {
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr << "Usage: bf <program.bf>\n";
+  const bool jit = argc == 3 && argv[1] == std::string_view("--jit");
+  if (argc != 2 && !jit) {
+    std::cerr << "Usage: bf [--jit] <program.bf>\n";
     return 1;
   }
-  std::ifstream file(argv[1]);
+  const char* filename = argv[argc - 1];
+  std::ifstream file(filename);
   std::string source{std::istreambuf_iterator<char>(file), {}};
-  auto program = link_jumps(combine(parse(argv[1], source)));
-  run(program);
+  auto program =
+      link_jumps(simplify_loops(combine(parse(filename, source))));
+  // Buffer output: std::cin is tied to std::cout, so prompts are still
+  // flushed before reading.
+  std::ios::sync_with_stdio(false);
+  if (jit) {
+    std::vector<int> cells(num_cells);
+    compiled_program{program}(cells.data());
+  } else {
+    run(program);
+  }
 }
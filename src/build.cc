@@ -1,17 +1,41 @@
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+import <algorithm>;
+import <atomic>;
+import <chrono>;
 import <filesystem>;
 import <fstream>;
 import <iomanip>;
 import <iostream>;
 import <map>;
-import <regex>;
+import <optional>;
+import <queue>;
 import <set>;
 import <string>;
+import <string_view>;
+import <thread>;
+import <vector>;
 
 namespace fs = std::filesystem;
-using std::literals::operator""ms;
 
 struct file_info {
   fs::file_time_type last_write_time;
+  std::uint64_t size = 0;
+  std::uint64_t hash = 0;
   std::string module_name;
   std::set<std::string> dependencies;
   bool from_cache = false;
@@ -19,61 +43,289 @@ struct file_info {
 
 constexpr char module_cache[] = "build/module_cache";
 
-const std::regex module_name_pattern{
-    R"(export\s+module\s+([a-zA-Z0-9_.]+)\s*;)"};
-const std::regex import_pattern{
-    R"(import\s+([a-zA-Z0-9_.]+|<[a-zA-Z0-9_./]+>|"[a-zA-Z0-9_./]+")\s*;)"};
+// A fast non-cryptographic hash of a file's contents, for change detection.
+std::uint64_t content_hash(std::string_view text) {
+  std::uint64_t hash = 0x9e3779b97f4a7c15 ^ text.size();
+  auto mix = [&](std::uint64_t word) {
+    hash = (hash ^ word) * 0xff51afd7ed558ccd;
+    hash ^= hash >> 32;
+  };
+  std::size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, text.data() + i, 8);
+    mix(word);
+  }
+  std::uint64_t word = 0;
+  // An empty view may have a null data pointer.
+  if (i < text.size()) std::memcpy(&word, text.data() + i, text.size() - i);
+  mix(word);
+  return hash;
+}
+
+// A read-only view of the contents of a file.
+class mapped_file {
+ public:
+  explicit mapped_file(const char* filename) {
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+      if (info.st_size == 0) {
+        ok_ = true;
+      } else if (void* data = mmap(nullptr, info.st_size, PROT_READ,
+                                   MAP_PRIVATE, fd, 0);
+                 data != MAP_FAILED) {
+        data_ = static_cast<const char*>(data);
+        size_ = info.st_size;
+        ok_ = true;
+      }
+    }
+    close(fd);
+  }
+
+  ~mapped_file() {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  bool ok() const { return ok_; }
+  std::string_view contents() const { return {data_, size_}; }
+
+ private:
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+  bool ok_ = false;
+};
+
+// A lexer for the module preamble: the declarations at the top of a file
+// which name the module and list its imports. Whitespace, comments,
+// preprocessor lines and the global module fragment are skipped, and lexing
+// stops at the first declaration which can't be part of the preamble, so the
+// rest of the file is never looked at.
+class preamble_lexer {
+ public:
+  explicit preamble_lexer(std::string_view text)
+      : i_(text.data()), end_(text.data() + text.size()) {}
+
+  void scan(std::string& module_name, std::set<std::string>& dependencies) {
+    while (true) {
+      skip_space();
+      if (i_ == end_) return;
+      if (*i_ == '#') {
+        skip_directive();
+        continue;
+      }
+      const bool exported = keyword("export");
+      if (keyword("module")) {
+        // `module;` introduces the global module fragment.
+        if (consume(';')) continue;
+        const auto name = module_path();
+        if (name.empty() || !consume(';')) return;
+        if (exported) module_name = name;
+      } else if (keyword("import")) {
+        const auto name = import_name();
+        if (name.empty() || !consume(';')) return;
+        dependencies.emplace(name);
+      } else {
+        return;
+      }
+    }
+  }
+
+ private:
+  static bool is_identifier(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+           ('0' <= c && c <= '9') || c == '_';
+  }
+
+  void skip_space() {
+    while (i_ != end_) {
+      if (*i_ == ' ' || *i_ == '\t' || *i_ == '\n' || *i_ == '\r') {
+        i_++;
+      } else if (starts_with("//")) {
+        i_ = std::find(i_, end_, '\n');
+      } else if (starts_with("/*")) {
+        const auto text = std::string_view(i_, end_ - i_);
+        const auto close = text.find("*/", 2);
+        i_ = close == text.npos ? end_ : i_ + close + 2;
+      } else {
+        return;
+      }
+    }
+  }
+
+  // Skip a preprocessor directive, including any continuation lines.
+  void skip_directive() {
+    while (i_ != end_) {
+      i_ = std::find(i_, end_, '\n');
+      if (i_ == end_) return;
+      const bool continued = i_[-1] == '\\';
+      i_++;
+      if (!continued) return;
+    }
+  }
+
+  bool starts_with(std::string_view prefix) const {
+    return std::string_view(i_, end_ - i_).starts_with(prefix);
+  }
+
+  bool keyword(std::string_view word) {
+    if (!starts_with(word)) return false;
+    const char* next = i_ + word.size();
+    if (next != end_ && is_identifier(*next)) return false;
+    i_ = next;
+    skip_space();
+    return true;
+  }
+
+  bool consume(char c) {
+    if (i_ == end_ || *i_ != c) return false;
+    i_++;
+    skip_space();
+    return true;
+  }
+
+  // A dotted module name such as util.io.
+  std::string_view module_path() {
+    const char* first = i_;
+    while (i_ != end_ && (is_identifier(*i_) || *i_ == '.')) i_++;
+    const auto result = std::string_view(first, i_ - first);
+    skip_space();
+    return result;
+  }
+
+  // A module name, or a header name including its delimiters.
+  std::string_view import_name() {
+    if (i_ == end_) return {};
+    if (*i_ != '<' && *i_ != '"') return module_path();
+    const char close = *i_ == '<' ? '>' : '"';
+    const char* first = i_;
+    const char* last = std::find(i_ + 1, end_, close);
+    if (last == end_ || std::find(first, last, '\n') != last) return {};
+    i_ = last + 1;
+    skip_space();
+    return std::string_view(first, i_ - first);
+  }
+
+  const char* i_;
+  const char* const end_;
+};
 
 struct state {
   void update() {
+    std::vector<fs::path> changed;
     for (auto entry : fs::recursive_directory_iterator("src")) {
       if (!is_regular_file(entry.status()) && !is_symlink(entry.status())) {
         continue;
       }
-      if (should_scan(entry.path())) scan(entry.path());
+      if (should_scan(entry)) changed.push_back(entry.path());
+    }
+    // Scan in parallel, then merge the results in a fixed order so that the
+    // output does not depend on the directory order or on thread timing.
+    std::sort(changed.begin(), changed.end());
+    std::vector<const file_info*> previous(changed.size());
+    for (std::size_t i = 0; i < changed.size(); i++) {
+      if (auto j = files.find(changed[i]); j != files.end()) {
+        previous[i] = &j->second;
+      }
+    }
+    std::vector<std::optional<file_info>> results(changed.size());
+    std::atomic<std::size_t> next = 0;
+    auto work = [&] {
+      for (std::size_t i; (i = next++) < changed.size();) {
+        results[i] = scan(changed[i], previous[i]);
+      }
+    };
+    const std::size_t num_threads = std::min<std::size_t>(
+        std::max(1u, std::thread::hardware_concurrency()), changed.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < num_threads; i++) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+    for (std::size_t i = 0; i < changed.size(); i++) {
+      if (results[i]) {
+        add(changed[i], std::move(*results[i]));
+      } else {
+        std::cerr << "error: can't open " << changed[i] << '\n';
+      }
     }
     prune();
+    index_modules();
+  }
+
+  // Rescan only the given files, which have changed on disk, or forget them
+  // if they have been removed.
+  void refresh(const std::vector<fs::path>& paths) {
+    for (const auto& path : paths) {
+      std::optional<file_info> info;
+      if (fs::is_regular_file(path)) {
+        auto i = files.find(path);
+        info = scan(path, i == files.end() ? nullptr : &i->second);
+        if (!info) std::cerr << "error: can't open " << path << '\n';
+      }
+      remove(path);
+      if (info) add(path, std::move(*info));
+    }
+    index_modules();
   }
 
-  bool should_scan(const fs::path& file) {
-    if (file.extension() != ".cc") return false;
-    auto i = files.find(file);
+  // The modification time and size are only a prefilter: a file whose
+  // metadata changed is hashed, and is only treated as changed if the hash
+  // differs too.
+  bool should_scan(const fs::directory_entry& entry) {
+    if (entry.path().extension() != ".cc") return false;
+    auto i = files.find(entry.path());
     if (i == files.end()) return true;
     i->second.from_cache = false;
-    auto last_write_time = fs::last_write_time(file);
-    return last_write_time > i->second.last_write_time;
+    return entry.last_write_time() != i->second.last_write_time ||
+           entry.file_size() != i->second.size;
   }
 
-  void scan(const fs::path& filename) {
-    std::ifstream file(filename.c_str());
-    if (!file.good()) {
-      std::cerr << "error: can't open " << filename << '\n';
-      return;
-    }
-    auto contents = std::string(std::istreambuf_iterator<char>(file), {});
-    std::string module_name;
-    if (std::smatch match; regex_search(contents, match, module_name_pattern)) {
-      module_name = match[1];
-    }
-    auto begin =
-        std::sregex_iterator(contents.begin(), contents.end(), import_pattern);
-    auto end = std::sregex_iterator();
-    std::set<std::string> dependencies;
-    for (auto i = begin; i != end; ++i) {
-      dependencies.insert((*i)[1]);
+  // Safe to call concurrently: it only reads the file and previous.
+  static std::optional<file_info> scan(const fs::path& filename,
+                                       const file_info* previous) {
+    const mapped_file file(filename.c_str());
+    if (!file.ok()) return std::nullopt;
+    const auto contents = file.contents();
+    file_info result;
+    std::error_code error;
+    result.last_write_time = fs::last_write_time(filename, error);
+    if (error) return std::nullopt;
+    result.size = contents.size();
+    result.hash = content_hash(contents);
+    if (previous && previous->size == result.size &&
+        previous->hash == result.hash) {
+      // Touched but not modified.
+      result.module_name = previous->module_name;
+      result.dependencies = previous->dependencies;
+      return result;
     }
+    preamble_lexer(contents).scan(result.module_name, result.dependencies);
+    return result;
+  }
+
+  void add(const fs::path& filename, file_info info) {
     auto& file_info = files[filename];
-    file_info.from_cache = false;
-    file_info.last_write_time = fs::last_write_time(filename);
-    file_info.module_name = module_name;
-    file_info.dependencies = dependencies;
-    if (module_name.empty()) {
-      binaries.push_back(filename);
+    file_info = std::move(info);
+    if (file_info.module_name.empty()) {
+      if (std::find(binaries.begin(), binaries.end(), filename) ==
+          binaries.end()) {
+        binaries.push_back(filename);
+      }
     } else {
-      modules.emplace(module_name, filename);
+      modules.emplace(file_info.module_name, filename);
     }
   }
 
+  void remove(const fs::path& filename) {
+    files.erase(filename);
+    std::erase(binaries, filename);
+    std::erase_if(modules, [&](const auto& m) { return m.second == filename; });
+  }
+
   void prune() {
     for (auto i = files.begin(); i != files.end();) {
       if (i->second.from_cache) {
@@ -89,85 +341,300 @@ struct state {
     return files.at(modules.at(module)).dependencies;
   }
 
-  std::set<std::string> recursive_dependencies(fs::path file) const {
-    const auto& dependencies = files.at(file).dependencies;
-    std::set<std::string> all;
-    for (const auto& d : dependencies) {
-      if (!modules.contains(d)) continue;
-      all.insert(d);
-      for (const auto& d2 : recursive_dependencies(modules.at(d))) {
-        if (modules.contains(d2)) all.insert(d2);
+  // Number the modules densely, in name order, and compute the set of modules
+  // that each one transitively imports. Modules are visited in topological
+  // order so that each closure is computed exactly once, from the closures
+  // of its direct imports.
+  void index_modules() {
+    has_cycle = false;
+    module_ids.clear();
+    module_names.clear();
+    for (const auto& [name, file] : modules) {
+      module_ids.emplace(name, module_names.size());
+      module_names.push_back(name);
+    }
+    const std::size_t num_modules = module_names.size();
+    closures.assign(num_modules, module_set((num_modules + 63) / 64));
+    enum status { unvisited, visiting, visited };
+    std::vector<status> statuses(num_modules, unvisited);
+    std::vector<int> path;
+    auto visit = [&](auto& visit, int id) -> void {
+      statuses[id] = visiting;
+      path.push_back(id);
+      const auto& file = files.at(modules.at(module_names[id]));
+      for (const auto& d : file.dependencies) {
+        auto i = module_ids.find(d);
+        if (i == module_ids.end()) continue;
+        const int dependency = i->second;
+        if (statuses[dependency] == visiting) {
+          has_cycle = true;
+          report_cycle(path, dependency);
+          continue;
+        }
+        if (statuses[dependency] == unvisited) visit(visit, dependency);
+        insert(closures[id], dependency);
+        merge(closures[id], closures[dependency]);
       }
+      path.pop_back();
+      statuses[id] = visited;
+    };
+    for (std::size_t id = 0; id < num_modules; id++) {
+      if (statuses[id] == unvisited) visit(visit, id);
     }
-    return all;
+  }
+
+  void report_cycle(const std::vector<int>& path, int start) const {
+    std::cerr << "error: import cycle: ";
+    auto i = std::find(path.begin(), path.end(), start);
+    for (; i != path.end(); ++i) std::cerr << module_names[*i] << " -> ";
+    std::cerr << module_names[start] << '\n';
+  }
+
+  // The modules which the given file transitively imports, in name order.
+  std::vector<std::string_view> recursive_dependencies(
+      const fs::path& file) const {
+    module_set all((module_names.size() + 63) / 64);
+    for (const auto& d : files.at(file).dependencies) {
+      auto i = module_ids.find(d);
+      if (i == module_ids.end()) continue;
+      insert(all, i->second);
+      merge(all, closures[i->second]);
+    }
+    std::vector<std::string_view> result;
+    for (std::size_t word = 0; word < all.size(); word++) {
+      for (auto bits = all[word]; bits; bits &= bits - 1) {
+        result.push_back(module_names[word * 64 + __builtin_ctzll(bits)]);
+      }
+    }
+    return result;
+  }
+
+  // A hash of the contents of a file and of every module it transitively
+  // imports: if this is unchanged, so is everything compiled from the file.
+  std::uint64_t inputs_hash(const fs::path& file) const {
+    std::string hashes = std::to_string(files.at(file).hash);
+    for (const auto& module : recursive_dependencies(file)) {
+      const auto& imported = files.at(modules.at(std::string(module)));
+      hashes += ' ' + std::to_string(imported.hash);
+    }
+    return content_hash(hashes);
   }
 
   std::map<fs::path, file_info> files;
   std::map<std::string, fs::path> modules;
   std::vector<fs::path> binaries;
+
+  // What each output was compiled from when run_jobs() last built it, and its
+  // modification time afterwards. An output whose time differs has been
+  // rebuilt by something else since, so the record no longer applies.
+  struct build_record {
+    fs::file_time_type output_time;
+    std::uint64_t inputs;
+  };
+  std::map<std::string, build_record> builds;
+
+  // A set of module ids.
+  using module_set = std::vector<std::uint64_t>;
+  static void insert(module_set& set, int id) {
+    set[id / 64] |= std::uint64_t{1} << id % 64;
+  }
+  static void merge(module_set& set, const module_set& other) {
+    for (std::size_t i = 0; i < set.size(); i++) set[i] |= other[i];
+  }
+
+  // Populated by index_modules().
+  std::map<std::string, int> module_ids;
+  std::vector<std::string> module_names;
+  std::vector<module_set> closures;
+  // Whether the modules import each other in a cycle, which can't be built.
+  bool has_cycle = false;
+};
+
+// The module cache is a single binary file which is mapped into memory:
+//
+//   cache_header
+//   cache_record[num_files]
+//   cache_build[num_builds]
+//   std::uint32_t dependencies[num_dependencies]  (string table offsets)
+//   char strings[strings_size]                    (NUL-terminated strings)
+//
+// Each record refers to a contiguous run of the dependency array.
+struct cache_header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t num_files;
+  std::uint32_t num_builds;
+  std::uint32_t num_dependencies;
+  std::uint32_t strings_size;
+};
+
+struct cache_record {
+  std::uint32_t path, module_name;
+  std::uint32_t first_dependency, num_dependencies;
+  std::int64_t last_write_time;
+  std::uint64_t size, hash;
 };
 
+// A state::build_record.
+struct cache_build {
+  std::uint32_t output, padding;
+  std::int64_t output_time;
+  std::uint64_t inputs;
+};
+
+constexpr char cache_magic[8] = {'m', 'o', 'd', 'c', 'a', 'c', 'h', 'e'};
+constexpr std::uint32_t cache_version = 3;
+
 state load_cache() {
-  std::ifstream file(module_cache);
-  if (!file.good()) return {};
+  const mapped_file file(module_cache);
+  const auto contents = file.contents();
+  if (contents.empty()) return {};
+  auto bad = [] {
+    std::cerr << "warning: bad module cache.\n";
+    return state{};
+  };
+  cache_header header;
+  if (contents.size() < sizeof(header)) return bad();
+  std::memcpy(&header, contents.data(), sizeof(header));
+  if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+      header.version != cache_version) {
+    return bad();
+  }
+  const std::size_t records_size =
+      std::size_t{header.num_files} * sizeof(cache_record);
+  const std::size_t builds_size =
+      std::size_t{header.num_builds} * sizeof(cache_build);
+  const std::size_t dependencies_size =
+      std::size_t{header.num_dependencies} * sizeof(std::uint32_t);
+  if (contents.size() != sizeof(header) + records_size + builds_size +
+                             dependencies_size + header.strings_size) {
+    return bad();
+  }
+  const auto* records =
+      reinterpret_cast<const cache_record*>(contents.data() + sizeof(header));
+  const auto* builds = reinterpret_cast<const cache_build*>(
+      contents.data() + sizeof(header) + records_size);
+  const auto* dependencies = reinterpret_cast<const std::uint32_t*>(
+      contents.data() + sizeof(header) + records_size + builds_size);
+  const char* strings = contents.data() + sizeof(header) + records_size +
+                        builds_size + dependencies_size;
+  // With a terminated table, every in-bounds offset is a valid string.
+  if (header.strings_size == 0 || strings[header.strings_size - 1] != '\0') {
+    return bad();
+  }
+  auto string = [&](std::uint32_t offset) -> std::optional<std::string_view> {
+    if (offset >= header.strings_size) return std::nullopt;
+    return strings + offset;
+  };
   state state;
-  fs::path name;
-  while (file >> name) {
+  for (std::uint32_t i = 0; i < header.num_files; i++) {
+    const auto& record = records[i];
+    const auto path = string(record.path);
+    const auto module_name = string(record.module_name);
+    if (!path || !module_name ||
+        record.first_dependency > header.num_dependencies ||
+        record.num_dependencies >
+            header.num_dependencies - record.first_dependency) {
+      return bad();
+    }
     file_info f;
     f.from_cache = true;
-    long time;
-    int num_dependencies;
-    file >> std::quoted(f.module_name) >> time >> num_dependencies;
-    if (!file) {
-      file.clear(std::ios::failbit);
-      std::string line;
-      std::getline(file, line);
-      std::cerr << "warning: bad module cache near " << std::quoted(line)
-                << '\n';
-      return {};
-    }
-    f.last_write_time = fs::file_time_type{} + time * 1ms;
-    for (int i = 0; i < num_dependencies; i++) {
-      std::string dependency;
-      file >> std::quoted(dependency);
-      if (!file) {
-        file.clear(std::ios::failbit);
-        std::string line;
-        std::getline(file, line);
-        std::cerr << "warning: bad module cache near " << std::quoted(line)
-                  << '\n';
-        return {};
-      }
-      f.dependencies.insert(dependency);
-    }
-    state.files.emplace(name, f);
+    f.last_write_time = fs::file_time_type(
+        fs::file_time_type::duration(record.last_write_time));
+    f.size = record.size;
+    f.hash = record.hash;
+    f.module_name = *module_name;
+    for (std::uint32_t j = 0; j < record.num_dependencies; j++) {
+      const auto dependency =
+          string(dependencies[record.first_dependency + j]);
+      if (!dependency) return bad();
+      f.dependencies.emplace(*dependency);
+    }
     if (f.module_name.empty()) {
-      state.binaries.push_back(name);
+      state.binaries.push_back(*path);
     } else {
-      state.modules.emplace(f.module_name, name);
+      state.modules.emplace(f.module_name, *path);
     }
+    state.files.emplace(*path, std::move(f));
+  }
+  for (std::uint32_t i = 0; i < header.num_builds; i++) {
+    const auto output = string(builds[i].output);
+    if (!output) return bad();
+    state.builds[std::string(*output)] = {
+        fs::file_time_type(
+            fs::file_time_type::duration(builds[i].output_time)),
+        builds[i].inputs};
   }
   return state;
 }
 
 void save_cache(const state& state) {
-  std::ofstream file(module_cache);
+  std::string strings;
+  std::map<std::string_view, std::uint32_t> offsets;
+  auto intern = [&](std::string_view value) {
+    auto [i, inserted] = offsets.emplace(value, strings.size());
+    if (inserted) {
+      strings += value;
+      strings += '\0';
+    }
+    return i->second;
+  };
+  std::vector<cache_record> records;
+  std::vector<std::uint32_t> dependencies;
   for (const auto& [name, info] : state.files) {
-    long time = info.last_write_time.time_since_epoch() / 1ms + 1;
-    file << name << " " << std::quoted(info.module_name) << " " << time << " "
-         << info.dependencies.size();
+    cache_record record = {};
+    record.path = intern(name.native());
+    record.module_name = intern(info.module_name);
+    record.first_dependency = dependencies.size();
+    record.num_dependencies = info.dependencies.size();
+    record.last_write_time = info.last_write_time.time_since_epoch().count();
+    record.size = info.size;
+    record.hash = info.hash;
+    records.push_back(record);
     for (const auto& dependency : info.dependencies) {
-      file << " " << std::quoted(dependency);
+      dependencies.push_back(intern(dependency));
     }
-    file << "\n";
   }
-  if (!file.good()) {
-    std::cerr << "warning: can't write module cache.\n";
-    return;
+  std::vector<cache_build> builds;
+  for (const auto& [output, build] : state.builds) {
+    cache_build record = {};
+    record.output = intern(output);
+    record.output_time = build.output_time.time_since_epoch().count();
+    record.inputs = build.inputs;
+    builds.push_back(record);
+  }
+  if (strings.empty()) strings += '\0';
+  cache_header header = {};
+  std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.version = cache_version;
+  header.num_files = records.size();
+  header.num_builds = builds.size();
+  header.num_dependencies = dependencies.size();
+  header.strings_size = strings.size();
+  // Write to a temporary file and then rename it so that a concurrent or
+  // interrupted build never sees a partial cache.
+  const std::string temporary = std::string(module_cache) + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(cache_record));
+    file.write(reinterpret_cast<const char*>(builds.data()),
+               builds.size() * sizeof(cache_build));
+    file.write(reinterpret_cast<const char*>(dependencies.data()),
+               dependencies.size() * sizeof(std::uint32_t));
+    file.write(strings.data(), strings.size());
+    if (!file.good()) {
+      std::cerr << "warning: can't write module cache.\n";
+      return;
+    }
   }
+  std::error_code error;
+  fs::rename(temporary, module_cache, error);
+  if (error) std::cerr << "warning: can't write module cache.\n";
 }
 
-void emit_rules(state state, std::string_view mode) {
+void emit_rules(const state& state, std::string_view mode) {
   // Emit make rules.
   for (const auto& [module, file] : state.modules) {
     // Rule to build the module interface for a module.
@@ -191,7 +658,7 @@ void emit_rules(state state, std::string_view mode) {
   for (const auto& binary : state.binaries) {
     std::cout << "\nbuild/" << mode << "/" << binary.stem().c_str()
               << ".o: " << binary.c_str();
-    for (const auto& dependency : state.files[binary].dependencies) {
+    for (const auto& dependency : state.files.at(binary).dependencies) {
       if (state.modules.contains(dependency)) {
         std::cout << " build/" << mode << "/" << dependency << ".pcm";
       }
@@ -211,14 +678,799 @@ void emit_rules(state state, std::string_view mode) {
   std::cout << "\n";
 }
 
-int main() {
-  // Scan the source directory and update the dependency graph.
-  auto state = load_cache();
+// Compiler settings for a build mode. These come from the environment
+// variables of the same names, which the Makefile exports, so that the
+// commands match the ones make would run.
+struct toolchain {
+  std::string cxx, mkbmi;
+  std::string base_cxxflags, mode_cxxflags, base_ldflags, mode_ldflags;
+
+  static toolchain from_environment(std::string_view mode) {
+    auto get = [](const std::string& name) {
+      const char* value = std::getenv(name.c_str());
+      return std::string(value ? value : "");
+    };
+    std::string prefix(mode);
+    for (char& c : prefix) c = std::toupper(c);
+    toolchain result;
+    result.cxx = get("CXX");
+    result.mkbmi = get("MKBMI");
+    result.base_cxxflags = get("BASE_CXXFLAGS");
+    result.mode_cxxflags = get(prefix + "_CXXFLAGS");
+    result.base_ldflags = get("BASE_LDFLAGS");
+    result.mode_ldflags = get(prefix + "_LDFLAGS");
+    return result;
+  }
+};
+
+// A single step of the build, equivalent to one make rule.
+struct job {
+  enum kind { interface, object, link };
+
+  job(enum kind kind, std::string output, std::vector<std::string> sources,
+      std::vector<std::string> interfaces)
+      : kind(kind), output(std::move(output)), sources(std::move(sources)),
+        interfaces(std::move(interfaces)) {}
+
+  enum kind kind;
+  std::string output;
+  // Inputs which appear on the command line.
+  std::vector<std::string> sources;
+  // Module interfaces which must be built first.
+  std::vector<std::string> interfaces;
+  // Jobs which produce the inputs of this job, and the jobs which consume
+  // the output of this one.
+  std::vector<int> dependencies, dependents;
+  // The length of the longest chain of jobs from this one to the end of the
+  // build, including this one.
+  int critical_path = 0;
+
+  std::string command(const toolchain& t) const {
+    std::string result =
+        (kind == interface ? t.mkbmi : t.cxx) + ' ' + t.base_cxxflags + ' ' +
+        t.mode_cxxflags;
+    if (kind != link) result += " -c";
+    for (const auto& source : sources) result += ' ' + source;
+    if (kind == link) result += ' ' + t.base_ldflags + ' ' + t.mode_ldflags;
+    return result + " -o " + output;
+  }
+};
+
+// The jobs for one build mode, mirroring the rules from emit_rules().
+std::vector<job> plan(const state& state, std::string_view mode) {
+  const std::string build = "build/" + std::string(mode) + "/";
+  std::vector<job> jobs;
+  auto interfaces = [&](const fs::path& file) {
+    std::vector<std::string> result;
+    for (const auto& dependency : state.files.at(file).dependencies) {
+      if (state.modules.contains(dependency)) {
+        result.push_back(build + dependency + ".pcm");
+      }
+    }
+    return result;
+  };
+  for (const auto& [module, file] : state.modules) {
+    jobs.emplace_back(job::interface, build + module + ".pcm",
+                      std::vector<std::string>{file}, interfaces(file));
+    jobs.emplace_back(job::object, build + module + ".o",
+                      std::vector<std::string>{file}, interfaces(file));
+  }
+  for (const auto& binary : state.binaries) {
+    const std::string stem = binary.stem();
+    jobs.emplace_back(job::object, build + stem + ".o",
+                      std::vector<std::string>{binary}, interfaces(binary));
+    std::vector<std::string> objects = {build + stem + ".o"};
+    for (const auto& dependency : state.recursive_dependencies(binary)) {
+      objects.push_back(build + std::string(dependency) + ".o");
+    }
+    jobs.emplace_back(job::link, "bin/" + std::string(mode) + "/" + stem,
+                      std::move(objects), std::vector<std::string>{});
+  }
+  std::map<std::string_view, int> producers;
+  for (std::size_t i = 0; i < jobs.size(); i++) producers[jobs[i].output] = i;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    for (const auto* inputs : {&jobs[i].sources, &jobs[i].interfaces}) {
+      for (const auto& input : *inputs) {
+        auto j = producers.find(input);
+        if (j == producers.end()) continue;
+        jobs[i].dependencies.push_back(j->second);
+        jobs[j->second].dependents.push_back(i);
+      }
+    }
+  }
+  auto critical_path = [&](auto& critical_path, int i) -> int {
+    auto& j = jobs[i];
+    if (j.critical_path > 0) return j.critical_path;
+    // A cycle, which index_modules() has already reported.
+    if (j.critical_path < 0) return 0;
+    j.critical_path = -1;
+    int longest = 0;
+    for (int d : j.dependents) {
+      longest = std::max(longest, critical_path(critical_path, d));
+    }
+    return j.critical_path = longest + 1;
+  };
+  for (std::size_t i = 0; i < jobs.size(); i++) critical_path(critical_path, i);
+  return jobs;
+}
+
+// Escape a path for use in a ninja build statement.
+std::string ninja_escape(std::string_view text) {
+  std::string result;
+  for (char c : text) {
+    if (c == ' ' || c == ':' || c == '$') result += '$';
+    result += c;
+  }
+  return result;
+}
+
+void emit_ninja(const state& state) {
+  std::cout << "# Generated by bin/debug/build --ninja.\n\n";
+  const auto debug = toolchain::from_environment("debug");
+  const auto opt = toolchain::from_environment("opt");
+  std::cout << "cxx = " << debug.cxx << "\n"
+            << "mkbmi = " << debug.mkbmi << "\n"
+            << "base_cxxflags = " << debug.base_cxxflags << "\n"
+            << "base_ldflags = " << debug.base_ldflags << "\n"
+            << "debug_cxxflags = " << debug.mode_cxxflags << "\n"
+            << "debug_ldflags = " << debug.mode_ldflags << "\n"
+            << "opt_cxxflags = " << opt.mode_cxxflags << "\n"
+            << "opt_ldflags = " << opt.mode_ldflags << "\n\n";
+  const toolchain variables = {"$cxx", "$mkbmi", "$base_cxxflags",
+                               "$mode_cxxflags", "$base_ldflags",
+                               "$mode_ldflags"};
+  for (auto kind : {job::interface, job::object, job::link}) {
+    const job pattern(kind, "$out", {"$in"}, {});
+    const char* name = kind == job::interface ? "pcm"
+                       : kind == job::object  ? "cxx"
+                                              : "link";
+    std::cout << "rule " << name << "\n  command = "
+              << pattern.command(variables) << "\n  description = "
+              << name << " $out\n\n";
+  }
+  for (std::string_view mode : {"debug", "opt"}) {
+    for (const auto& j : plan(state, mode)) {
+      std::cout << "build " << ninja_escape(j.output) << ": "
+                << (j.kind == job::interface ? "pcm"
+                    : j.kind == job::object  ? "cxx"
+                                             : "link");
+      for (const auto& source : j.sources) {
+        std::cout << ' ' << ninja_escape(source);
+      }
+      if (!j.interfaces.empty()) std::cout << " |";
+      for (const auto& interface : j.interfaces) {
+        std::cout << ' ' << ninja_escape(interface);
+      }
+      std::cout << "\n  mode_cxxflags = $" << mode << "_cxxflags\n"
+                << "  mode_ldflags = $" << mode << "_ldflags\n";
+    }
+    std::cout << "\nbuild " << mode << ": phony";
+    for (const auto& binary : state.binaries) {
+      std::cout << " bin/" << mode << "/" << binary.stem().c_str();
+    }
+    std::cout << "\n\n";
+  }
+  std::cout << "build all: phony opt debug\ndefault debug\n";
+}
+
+// Whether the output of a job is older than any of its inputs.
+bool out_of_date(const job& j) {
+  std::error_code error;
+  const auto output = fs::last_write_time(j.output, error);
+  if (error) return true;
+  for (const auto* inputs : {&j.sources, &j.interfaces}) {
+    for (const auto& input : *inputs) {
+      const auto time = fs::last_write_time(input, error);
+      if (error || time > output) return true;
+    }
+  }
+  return false;
+}
+
+// A local store of compiler outputs (.pcm and .o files), addressed by a hash
+// of everything that went into them: the preprocessed source and the header
+// units it imports, the compiler and its flags, and the keys of the module
+// interfaces it imports. Restoring an output is a file copy. Entries are
+// touched when used, and the cache is trimmed back to its size limit after
+// each build by evicting the least recently used entries.
+//
+// BUILD_CACHE sets the directory (build/cache by default) and
+// BUILD_CACHE_SIZE the limit in MiB (2048 by default, 0 disables the cache).
+class compile_cache {
+ public:
+  compile_cache(const state& state, const std::vector<job>& jobs,
+                const toolchain& tools)
+      : state_(state), jobs_(jobs), tools_(tools), keys_(jobs.size()) {
+    const char* directory = std::getenv("BUILD_CACHE");
+    const char* size = std::getenv("BUILD_CACHE_SIZE");
+    directory_ = directory && *directory ? directory : "build/cache";
+    max_size_ = (size && *size ? std::atoll(size) : 2048) << 20;
+    for (std::size_t i = 0; i < jobs.size(); i++) {
+      producers_.emplace(jobs[i].output, i);
+    }
+  }
+
+  bool enabled() const { return max_size_ > 0; }
+
+  // Preprocess everything that the keys of the given jobs depend on, running
+  // up to max_running preprocessors at once, so that key() doesn't have to
+  // run any while jobs are waiting to be started.
+  void prepare(const std::vector<int>& candidates, int max_running) {
+    std::set<std::string> needed;
+    std::vector<bool> seen(jobs_.size());
+    auto visit = [&](auto& visit, int i) -> void {
+      if (seen[i]) return;
+      seen[i] = true;
+      const auto& j = jobs_[i];
+      if (j.kind == job::link || j.sources.size() != 1) return;
+      needed.insert(j.sources[0]);
+      for (auto& unit : header_units(j.sources[0])) needed.insert(unit);
+      for (const auto& interface : j.interfaces) {
+        auto producer = producers_.find(interface);
+        if (producer != producers_.end()) visit(visit, producer->second);
+      }
+    };
+    for (int i : candidates) visit(visit, i);
+    std::vector<std::string> sources;
+    for (const auto& source : needed) {
+      if (!sources_.contains(source)) sources.push_back(source);
+    }
+    std::vector<std::optional<std::uint64_t>> results(sources.size());
+    std::atomic<std::size_t> next = 0;
+    auto work = [&] {
+      for (std::size_t i; (i = next++) < sources.size();) {
+        results[i] = preprocess(sources[i]);
+      }
+    };
+    const std::size_t num_threads =
+        std::min<std::size_t>(max_running, sources.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < num_threads; i++) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+    for (std::size_t i = 0; i < sources.size(); i++) {
+      sources_.emplace(sources[i], results[i]);
+    }
+  }
+
+  // The key for a job, or nullopt if its output can't be cached.
+  std::optional<std::uint64_t> key(int i) {
+    auto& result = keys_[i];
+    if (result.computed) return result.key;
+    result.computed = true;
+    const auto& j = jobs_[i];
+    if (j.kind == job::link || j.sources.size() != 1) return std::nullopt;
+    const auto source = preprocessed(j.sources[0]);
+    if (!source) return std::nullopt;
+    std::string inputs = j.kind == job::interface ? tools_.mkbmi : tools_.cxx;
+    inputs += '\0' + tools_.base_cxxflags + '\0' + tools_.mode_cxxflags;
+    inputs += '\0' + std::to_string(*source);
+    for (const auto& unit : header_units(j.sources[0])) {
+      const auto header = preprocessed(unit);
+      if (!header) return std::nullopt;
+      inputs += '\0' + unit + '\0' + std::to_string(*header);
+    }
+    for (const auto& interface : j.interfaces) {
+      auto producer = producers_.find(interface);
+      if (producer == producers_.end()) return std::nullopt;
+      const auto imported = key(producer->second);
+      if (!imported) return std::nullopt;
+      inputs += '\0' + std::to_string(*imported);
+    }
+    return result.key = content_hash(inputs);
+  }
+
+  // Copy a cached output into place, if there is one.
+  bool restore(std::uint64_t key, const std::string& output) {
+    const auto entry = path(key);
+    const std::string temporary = output + ".tmp";
+    std::error_code error;
+    fs::copy_file(entry, temporary, fs::copy_options::overwrite_existing,
+                  error);
+    if (error) return false;
+    fs::rename(temporary, output, error);
+    if (error) return false;
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), error);
+    return true;
+  }
+
+  void store(std::uint64_t key, const std::string& output) {
+    const auto entry = path(key);
+    const auto temporary = entry.string() + ".tmp";
+    std::error_code error;
+    fs::create_directories(directory_, error);
+    fs::copy_file(output, temporary, fs::copy_options::overwrite_existing,
+                  error);
+    if (!error) fs::rename(temporary, entry, error);
+    if (error) std::cerr << "warning: can't cache " << output << '\n';
+  }
+
+  // Evict the least recently used entries until the cache fits its limit.
+  void trim() const {
+    struct entry {
+      fs::file_time_type last_used;
+      std::uintmax_t size;
+      fs::path path;
+    };
+    std::vector<entry> entries;
+    std::uintmax_t total = 0;
+    std::error_code error;
+    for (const auto& e : fs::directory_iterator(directory_, error)) {
+      const auto size = e.file_size(error);
+      if (error) continue;
+      entries.push_back({e.last_write_time(), size, e.path()});
+      total += size;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const entry& l, const entry& r) {
+                return l.last_used < r.last_used;
+              });
+    for (const auto& e : entries) {
+      if (total <= (std::uintmax_t)max_size_) break;
+      if (fs::remove(e.path, error)) total -= e.size;
+    }
+  }
+
+ private:
+  struct cached_key {
+    bool computed = false;
+    std::optional<std::uint64_t> key;
+  };
+
+  fs::path path(std::uint64_t key) const {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return directory_ / name;
+  }
+
+  // The files of the header units which a source imports with `import "...";`,
+  // found next to the source or else under src. `-E` leaves imports alone, so
+  // these are hashed separately. Standard library header units (`import
+  // <...>;`) are taken to be fixed for a given compiler and flags.
+  std::vector<std::string> header_units(const std::string& source) const {
+    std::vector<std::string> result;
+    auto file = state_.files.find(source);
+    if (file == state_.files.end()) return result;
+    for (const auto& d : file->second.dependencies) {
+      if (d.size() < 2 || d.front() != '"') continue;
+      const fs::path name = d.substr(1, d.size() - 2);
+      auto path = fs::path(source).parent_path() / name;
+      if (!fs::exists(path)) path = "src" / name;
+      result.push_back(path.string());
+    }
+    return result;
+  }
+
+  std::optional<std::uint64_t> preprocessed(const std::string& source) {
+    if (auto i = sources_.find(source); i != sources_.end()) return i->second;
+    return sources_[source] = preprocess(source);
+  }
+
+  // Hash the preprocessed source, so that changes to included headers (and
+  // to the macros they define) are part of the key but edits to comments
+  // are not. Line markers are kept since they end up in debug info. If the
+  // preprocessor fails, its output may be empty or partial, so the source
+  // gets no hash and the jobs which compile it are not cached. Safe to call
+  // concurrently.
+  std::optional<std::uint64_t> preprocess(const std::string& source) const {
+    const std::string command = tools_.cxx + ' ' + tools_.base_cxxflags +
+                                ' ' + tools_.mode_cxxflags + " -E " + source +
+                                " 2>/dev/null";
+    std::optional<std::uint64_t> result;
+    if (FILE* output = popen(command.c_str(), "r")) {
+      std::string text;
+      char buffer[65536];
+      while (const auto n = std::fread(buffer, 1, sizeof(buffer), output)) {
+        text.append(buffer, n);
+      }
+      const bool read_all = !std::ferror(output);
+      const int status = pclose(output);
+      if (read_all && status != -1 && WIFEXITED(status) &&
+          WEXITSTATUS(status) == 0) {
+        result = content_hash(text);
+      }
+    }
+    return result;
+  }
+
+  const state& state_;
+  const std::vector<job>& jobs_;
+  const toolchain& tools_;
+  fs::path directory_;
+  long long max_size_;
+  std::map<std::string, int> producers_;
+  std::vector<cached_key> keys_;
+  std::map<std::string, std::optional<std::uint64_t>> sources_;
+};
+
+// Measurements of a job run by run_jobs().
+struct timing {
+  bool ran = false;
+  std::chrono::steady_clock::time_point start, end;
+  // The slot the job ran in, from 0 to max_running - 1.
+  int slot = 0;
+  long peak_rss_kb = 0;
+
+  double seconds() const {
+    return ran ? std::chrono::duration<double>(end - start).count() : 0;
+  }
+};
+
+// Write a report of the jobs which ran, slowest first, and a trace which can
+// be loaded into chrome://tracing or Perfetto. Jobs on the critical path of
+// the build (the chain of dependent jobs with the largest total run time)
+// are marked in both.
+void write_profile(const std::vector<job>& jobs,
+                   const std::vector<timing>& timings, std::string_view mode,
+                   std::chrono::steady_clock::time_point start) {
+  // Longest path by measured time, in dependency order.
+  std::vector<double> finish(jobs.size(), -1);
+  std::vector<int> previous(jobs.size(), -1);
+  auto longest = [&](auto& longest, int i) -> double {
+    if (finish[i] >= 0) return finish[i];
+    double before = 0;
+    for (int d : jobs[i].dependencies) {
+      if (const double t = longest(longest, d); t > before) {
+        before = t;
+        previous[i] = d;
+      }
+    }
+    return finish[i] = before + timings[i].seconds();
+  };
+  int last = -1;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    if (last < 0 || longest(longest, i) > finish[last]) last = i;
+  }
+  std::vector<bool> critical(jobs.size());
+  std::vector<int> path;
+  for (int i = last; i >= 0; i = previous[i]) {
+    if (timings[i].ran) path.push_back(i);
+    critical[i] = true;
+  }
+  std::reverse(path.begin(), path.end());
+
+  std::vector<int> ran;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    if (timings[i].ran) ran.push_back(i);
+  }
+  if (ran.empty()) return;
+  std::sort(ran.begin(), ran.end(), [&](int l, int r) {
+    return timings[l].seconds() > timings[r].seconds();
+  });
+
+  const std::string directory = "build/" + std::string(mode) + "/";
+  std::ofstream report(directory + "profile.txt");
+  const auto wall = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  report << std::fixed;
+  report.precision(3);
+  report << "wall time: " << wall << "s\ncritical path: "
+         << (last >= 0 ? finish[last] : 0) << "s\n";
+  for (std::size_t k = 0; k < path.size(); k++) {
+    report << (k ? " -> " : "  ") << jobs[path[k]].output;
+  }
+  report << "\n\n    time(s)   rss(MiB)  target (* = critical path)\n";
+  for (int i : ran) {
+    report << (critical[i] ? '*' : ' ') << std::setw(10)
+           << timings[i].seconds() << ' ' << std::setw(10)
+           << timings[i].peak_rss_kb / 1024.0 << "  " << jobs[i].output
+           << '\n';
+  }
+
+  std::ofstream trace(directory + "trace.json");
+  trace << "{\"traceEvents\":[";
+  const char* separator = "";
+  for (int i : ran) {
+    const auto& t = timings[i];
+    auto microseconds = [](auto duration) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+          .count();
+    };
+    const char* kind = jobs[i].kind == job::interface ? "pcm"
+                       : jobs[i].kind == job::object  ? "cxx"
+                                                      : "link";
+    trace << separator << "\n{\"name\":\"" << jobs[i].output
+          << "\",\"cat\":\"" << kind << "\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+          << t.slot << ",\"ts\":" << microseconds(t.start - start)
+          << ",\"dur\":" << microseconds(t.end - t.start)
+          << ",\"args\":{\"peak_rss_kb\":" << t.peak_rss_kb
+          << ",\"critical\":" << (critical[i] ? "true" : "false") << '}';
+    // Highlight the critical path in a different colour.
+    if (critical[i]) trace << ",\"cname\":\"terrible\"";
+    trace << '}';
+    separator = ",";
+  }
+  trace << "\n]}\n";
+  std::cerr << "note: wrote " << directory << "profile.txt and " << directory
+            << "trace.json\n";
+}
+
+// Build everything for the given mode, running up to max_running commands at
+// once. Among the jobs which are ready to run, the ones with the
+// longest chain of dependents go first, so that module interfaces which
+// gate the rest of the build are never left waiting behind leaf objects.
+int run_jobs(state& state, std::string_view mode, int max_running) {
+  if (state.has_cycle) {
+    std::cerr << "error: not building while there is an import cycle.\n";
+    return 1;
+  }
+  auto jobs = plan(state, mode);
+  const auto tools = toolchain::from_environment(mode);
+  if (tools.cxx.empty() || tools.mkbmi.empty()) {
+    std::cerr << "error: CXX and MKBMI must be set (run via make).\n";
+    return 1;
+  }
+  auto by_priority = [&](int l, int r) {
+    return jobs[l].critical_path < jobs[r].critical_path;
+  };
+  std::priority_queue<int, std::vector<int>, decltype(by_priority)> ready(
+      by_priority);
+  std::vector<int> waiting(jobs.size());
+  std::vector<timing> timings(jobs.size());
+  std::vector<bool> free_slots(max_running, true);
+  compile_cache cache(state, jobs, tools);
+  std::vector<std::optional<std::uint64_t>> keys(jobs.size());
+  // Whether the output of a compile job was built by us from what its inputs
+  // contain now, so that an input which was touched but not changed doesn't
+  // rebuild it.
+  auto inputs = [&](const job& j) -> std::optional<std::uint64_t> {
+    if (j.kind == job::link || j.sources.size() != 1) return std::nullopt;
+    return state.inputs_hash(j.sources[0]);
+  };
+  auto unchanged = [&](const job& j) {
+    auto build = state.builds.find(j.output);
+    if (build == state.builds.end()) return false;
+    std::error_code error;
+    const auto time = fs::last_write_time(j.output, error);
+    return !error && time == build->second.output_time &&
+           inputs(j) == build->second.inputs;
+  };
+  auto record = [&](const job& j) {
+    std::error_code error;
+    const auto time = fs::last_write_time(j.output, error);
+    if (const auto hash = inputs(j); hash && !error) {
+      state.builds[j.output] = {time, *hash};
+    }
+  };
+  // Jobs which are out of date now. The jobs downstream of them may become
+  // out of date too, so their cache keys are prepared up front as well.
+  std::vector<bool> stale(jobs.size());
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    stale[i] = out_of_date(jobs[i]) && !unchanged(jobs[i]);
+  }
+  if (cache.enabled()) {
+    std::vector<int> candidates;
+    std::vector<bool> seen(jobs.size());
+    auto visit = [&](auto& visit, int i) -> void {
+      if (seen[i]) return;
+      seen[i] = true;
+      candidates.push_back(i);
+      for (int d : jobs[i].dependents) visit(visit, d);
+    };
+    for (std::size_t i = 0; i < jobs.size(); i++) {
+      if (stale[i]) visit(visit, i);
+    }
+    cache.prepare(candidates, max_running);
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    waiting[i] = jobs[i].dependencies.size();
+    if (waiting[i] == 0) ready.push(i);
+  }
+  auto finish = [&](int i) {
+    for (int d : jobs[i].dependents) {
+      if (--waiting[d] == 0) ready.push(d);
+    }
+  };
+  std::map<pid_t, int> running;
+  bool failed = false;
+  while (true) {
+    while (!failed && (int)running.size() < max_running && !ready.empty()) {
+      const int i = ready.top();
+      ready.pop();
+      const auto& j = jobs[i];
+      const bool rebuilt_input = std::any_of(
+          j.dependencies.begin(), j.dependencies.end(),
+          [&](int d) { return timings[d].ran; });
+      if (!rebuilt_input && !stale[i]) {
+        finish(i);
+        continue;
+      }
+      fs::create_directories(fs::path(j.output).parent_path());
+      if (cache.enabled()) keys[i] = cache.key(i);
+      if (keys[i] && cache.restore(*keys[i], j.output)) {
+        std::cout << "restored " << j.output << " from cache" << std::endl;
+        record(j);
+        auto& t = timings[i];
+        t.start = t.end = std::chrono::steady_clock::now();
+        t.ran = true;
+        finish(i);
+        continue;
+      }
+      const std::string command = j.command(tools);
+      std::cout << command << std::endl;
+      const char* argv[] = {"sh", "-c", command.c_str(), nullptr};
+      pid_t pid;
+      if (posix_spawn(&pid, "/bin/sh", nullptr, nullptr,
+                      const_cast<char**>(argv), environ) != 0) {
+        std::cerr << "error: can't run " << command << '\n';
+        failed = true;
+        break;
+      }
+      running.emplace(pid, i);
+      auto& t = timings[i];
+      t.start = std::chrono::steady_clock::now();
+      t.slot = std::find(free_slots.begin(), free_slots.end(), true) -
+               free_slots.begin();
+      free_slots[t.slot] = false;
+    }
+    if (running.empty()) break;
+    int status;
+    rusage usage;
+    const pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) continue;
+    const int i = running.at(pid);
+    running.erase(pid);
+    auto& t = timings[i];
+    t.end = std::chrono::steady_clock::now();
+    t.peak_rss_kb = usage.ru_maxrss;
+    free_slots[t.slot] = true;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      t.ran = true;
+      record(jobs[i]);
+      if (keys[i]) cache.store(*keys[i], jobs[i].output);
+      finish(i);
+    } else {
+      std::cerr << "error: failed to build " << jobs[i].output << '\n';
+      failed = true;
+    }
+  }
+  if (cache.enabled()) cache.trim();
+  write_profile(jobs, timings, mode, start);
+  return failed ? 1 : 0;
+}
+
+// Reports changes to .cc files anywhere under a directory, using inotify.
+class watcher {
+ public:
+  explicit watcher(const fs::path& root) : fd_(inotify_init1(IN_CLOEXEC)) {
+    if (fd_ < 0) return;
+    watch(root);
+    for (const auto& entry : fs::recursive_directory_iterator(root)) {
+      if (entry.is_directory()) watch(entry.path());
+    }
+  }
+  ~watcher() {
+    if (fd_ >= 0) close(fd_);
+  }
+  watcher(const watcher&) = delete;
+  watcher& operator=(const watcher&) = delete;
+
+  bool ok() const { return fd_ >= 0; }
+
+  // Block until something changes, then keep collecting events until none
+  // have arrived for a short while, so that an editor saving several files
+  // (or saving one file in several steps) triggers a single rebuild.
+  std::vector<fs::path> wait() {
+    std::set<fs::path> changed;
+    int timeout = -1;
+    pollfd p = {fd_, POLLIN, 0};
+    while (poll(&p, 1, timeout) > 0) {
+      read_events(changed);
+      timeout = 50;
+    }
+    return {changed.begin(), changed.end()};
+  }
+
+ private:
+  static constexpr std::uint32_t mask = IN_CLOSE_WRITE | IN_CREATE |
+                                        IN_DELETE | IN_MOVED_FROM |
+                                        IN_MOVED_TO | IN_DELETE_SELF;
+
+  void watch(const fs::path& directory) {
+    const int wd = inotify_add_watch(fd_, directory.c_str(), mask);
+    if (wd >= 0) directories_[wd] = directory;
+  }
+
+  void read_events(std::set<fs::path>& changed) {
+    alignas(inotify_event) char buffer[4096];
+    const ssize_t length = read(fd_, buffer, sizeof(buffer));
+    for (ssize_t offset = 0; offset < length;) {
+      const auto* event = reinterpret_cast<const inotify_event*>(
+          buffer + offset);
+      offset += sizeof(inotify_event) + event->len;
+      if (event->mask & IN_IGNORED) {
+        directories_.erase(event->wd);
+        continue;
+      }
+      auto i = directories_.find(event->wd);
+      if (i == directories_.end() || event->len == 0) continue;
+      const fs::path path = i->second / event->name;
+      if (event->mask & IN_ISDIR) {
+        // A new directory may already contain files by the time it is
+        // watched, so report those too.
+        if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+        watch(path);
+        std::error_code error;
+        for (const auto& entry :
+             fs::recursive_directory_iterator(path, error)) {
+          if (entry.is_directory()) watch(entry.path());
+          if (entry.path().extension() == ".cc") changed.insert(entry.path());
+        }
+      } else if (path.extension() == ".cc" && !(event->mask & IN_CREATE)) {
+        // Creation is followed by IN_CLOSE_WRITE once the file is written.
+        changed.insert(path);
+      }
+    }
+  }
+
+  int fd_;
+  std::map<int, fs::path> directories_;
+};
+
+// Build, then rebuild whenever a source file changes. The dependency graph
+// stays in memory: only the files which changed are rescanned, and only the
+// targets which depend on them are rebuilt.
+int watch(state& state, std::string_view mode, int max_running) {
+  watcher watcher("src");
+  if (!watcher.ok()) {
+    std::cerr << "error: can't watch src: " << std::strerror(errno) << '\n';
+    return 1;
+  }
+  // Scan only now, so that nothing can change between the scan and the
+  // watches being in place.
   state.update();
-  save_cache(state);
+  while (true) {
+    run_jobs(state, mode, max_running);
+    save_cache(state);
+    std::cerr << "note: watching src for changes\n";
+    state.refresh(watcher.wait());
+  }
+}
 
-  // Emit make rules.
-  emit_rules(state, "debug");
-  emit_rules(state, "opt");
-  std::cout << "all: opt debug\n";
+// Usage:
+//   build               Print make rules for every target.
+//   build --ninja       Print an equivalent build.ninja.
+//   build --run [MODE [JOBS]]
+//                       Build MODE (debug by default) without make, running
+//                       up to JOBS commands at once (one per core by default).
+//   build --watch [MODE [JOBS]]
+//                       As --run, then rebuild whenever a file in src changes.
+int main(int argc, char* argv[]) {
+  const std::string_view command = argc > 1 ? argv[1] : "";
+  // Scan the source directory and update the dependency graph. watch() does
+  // this itself, once its watches are in place.
+  auto state = load_cache();
+  if (command != "--watch") {
+    state.update();
+    save_cache(state);
+  }
+
+  if (command == "--ninja") {
+    // index_modules() has reported the cycle.
+    if (state.has_cycle) return 1;
+    emit_ninja(state);
+  } else if (command == "--run" || command == "--watch") {
+    const std::string_view mode = argc > 2 ? argv[2] : "debug";
+    if (mode != "debug" && mode != "opt") {
+      std::cerr << "error: unknown mode " << mode << '\n';
+      return 1;
+    }
+    const int jobs = argc > 3 ? std::atoi(argv[3])
+                              : std::thread::hardware_concurrency();
+    if (command == "--watch") return watch(state, mode, std::max(jobs, 1));
+    const int status = run_jobs(state, mode, std::max(jobs, 1));
+    save_cache(state);
+    return status;
+  } else if (command.empty()) {
+    // Emit make rules.
+    emit_rules(state, "debug");
+    emit_rules(state, "opt");
+    std::cout << "all: opt debug\n";
+  } else {
+    std::cerr << "usage: " << argv[0]
+              << " [--ninja | --run|--watch [debug|opt [jobs]]]\n";
+    return 1;
+  }
 }
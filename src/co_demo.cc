@@ -1,8 +1,18 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+import "util/check.h";
 import util.coroutine;
+import <atomic>;
 import <chrono>;
 import <coroutine>;
 import <iostream>;
+import <memory>;
+import <numeric>;
 import <optional>;
+import <stdexcept>;
+import <string>;
+import <string_view>;
 import <vector>;
 
 using namespace std::chrono_literals;
@@ -22,6 +32,146 @@ promise<int> consume() {
   co_return 0;
 }
 
+promise<int> square(int x) {
+  co_await 10ms;
+  co_return x * x;
+}
+
+promise<int> fail() {
+  co_await 10ms;
+  throw std::runtime_error("oops");
+}
+
+promise<int> add_square(int& total, int x) {
+  total += co_await square(x);
+  co_return 0;
+}
+
+promise<int> structured() {
+  auto [a, b] = co_await when_all(square(3), square(4));
+  std::cout << "when_all: " << a << " + " << b << " = " << a + b << '\n';
+  try {
+    co_await when_all(square(5), fail());
+  } catch (const std::exception& error) {
+    std::cout << "when_all threw: " << error.what() << '\n';
+  }
+  int total = 0;
+  task_group group;
+  for (int i = 1; i <= 4; i++) group.spawn([&total, i] { total += i; });
+  group.spawn([&total] { return add_square(total, 5); });
+  co_await group.wait();
+  std::cout << "task_group total: " << total << '\n';
+  std::vector<int> values(100);
+  std::iota(values.begin(), values.end(), 0);
+  co_await parallel_for(values, 16, [](int& x) { x *= 2; });
+  std::cout << "parallel_for sum: "
+            << std::accumulate(values.begin(), values.end(), 0) << '\n';
+  co_return 0;
+}
+
+// Runs on a thread_pool_executor, so the chunks run in parallel and the
+// coroutine may resume on a different thread after each await.
+promise<int> pool_work() {
+  std::vector<long> values(100'000);
+  std::iota(values.begin(), values.end(), 0);
+  co_await parallel_for(values, 1000, [](long& x) { x = x * x % 1000; });
+  co_await 10ms;
+  std::cout << "thread pool sum: "
+            << std::accumulate(values.begin(), values.end(), 0L) << '\n';
+  co_return 0;
+}
+
+// A ring of stages connected by channels, like the day 7 amplifiers: each
+// stage transforms every value it receives and passes it on, until one of
+// them produces a value over the limit. Closing a channel shuts down the
+// stage which reads from it, which closes its own output, and so on.
+promise<int> amplifier(channel<long>& input, channel<long>& output, int phase,
+                       long& result) {
+  while (auto value = co_await input.receive()) {
+    const long next = *value * 2 + phase;
+    if (next > 1'000'000) {
+      result = next;
+      break;
+    }
+    if (!co_await output.send(next)) break;
+  }
+  output.close();
+  co_return 0;
+}
+
+promise<int> pipeline() {
+  constexpr int phases[] = {5, 6, 7, 8, 9};
+  constexpr int n = std::size(phases);
+  std::vector<std::unique_ptr<channel<long>>> links;
+  for (int i = 0; i < n; i++) {
+    links.push_back(std::make_unique<channel<long>>(2));
+  }
+  long result = 0;
+  std::vector<promise<int>> stages;
+  for (int i = 0; i < n; i++) {
+    stages.push_back(
+        amplifier(*links[i], *links[(i + 1) % n], phases[i], result));
+  }
+  co_await links[0]->send(0);
+  for (auto& stage : stages) co_await stage;
+  std::cout << "pipeline result: " << result << '\n';
+  co_return 0;
+}
+
+// Senders blocked on a full channel race with close(). Every value which a
+// send reports as delivered must reach the receiver.
+promise<int> send_until_closed(channel<int>& c, std::atomic<int>& sent) {
+  for (int i = 0; co_await c.send(i); i++) sent++;
+  co_return 0;
+}
+
+promise<int> receive_until_closed(channel<int>& c,
+                                  std::atomic<int>& received) {
+  while (auto value = co_await c.receive()) received++;
+  co_return 0;
+}
+
+promise<int> close_race() {
+  for (int round = 0; round < 200; round++) {
+    channel<int> c(2);
+    std::atomic<int> sent = 0, received = 0;
+    std::vector<promise<int>> tasks;
+    for (int i = 0; i < 4; i++) tasks.push_back(send_until_closed(c, sent));
+    tasks.push_back(receive_until_closed(c, received));
+    co_await 1ms;
+    c.close();
+    for (auto& task : tasks) co_await task;
+    check(sent == received);
+  }
+  std::cout << "close race: ok\n";
+  co_return 0;
+}
+
+// Passes messages through a pipe between two coroutines on an io_executor.
+// The writer pauses between messages, so the reader has to wait for the pipe
+// to become readable each time.
+promise<int> pipe_writer(int fd) {
+  for (std::string_view message : {"hello ", "from ", "a pipe\n"}) {
+    co_await 20ms;
+    check(co_await async_write(fd, message) == (long)message.size());
+  }
+  close(fd);
+  co_return 0;
+}
+
+promise<int> pipe_reader(int fd) {
+  std::string text;
+  char buffer[64];
+  while (true) {
+    const auto n = co_await async_read(fd, buffer);
+    if (n <= 0) break;
+    text.append(buffer, n);
+  }
+  close(fd);
+  std::cout << "read from pipe: " << text;
+  co_return 0;
+}
+
 struct noisy {
   noisy() { std::cout << "noisy()\n"; }
   ~noisy() { std::cout << "~noisy()\n"; }
@@ -38,8 +188,38 @@ int main() {
   int total = 0;
   for (auto x : gen()) total += x;
   std::cout << "total: " << total << '\n';
+  // The even squares below 1000, halved, in groups of four.
+  auto groups = gen() | filter([](int x) { return x % 2 == 0; }) |
+                take_while([](int x) { return x < 1000; }) |
+                transform([](int x) { return x / 2; }) | chunk(4);
+  for (auto group : groups) {
+    std::cout << "group:";
+    for (int x : group) std::cout << ' ' << x;
+    std::cout << '\n';
+  }
   series_executor executor;
   set_executor set(&executor);
   consume();
+  structured();
   executor.run();
+
+  int fds[2];
+  check(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0);
+  io_executor io;
+  {
+    set_executor set(&io);
+    pipe_reader(fds[0]);
+    pipe_writer(fds[1]);
+  }
+  io.run();
+
+  thread_pool_executor pool(4);
+  executor_stats stats;
+  pool.instrument(&stats);
+  pool.schedule([] { pool_work(); });
+  pool.schedule([] { pipeline(); });
+  pool.schedule([] { close_race(); });
+  pool.run();
+  std::cout << "thread pool stats:\n";
+  stats.print(std::cout);
 }
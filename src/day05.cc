@@ -18,8 +18,7 @@ program::value_type run(program::const_span source, program::value_type value) {
 }
 
 int main(int argc, char* argv[]) {
-  program::buffer buffer;
-  auto source = program::load(init(argc, argv), buffer);
+  auto source = program::load_file(input_filename(argc, argv));
   std::cout << "part1 " << run(source, 1) << '\n'
             << "part2 " << run(source, 5) << '\n';
 }
@@ -2,12 +2,21 @@ import "util/check.h";
 import <array>;
 import <charconv>;  // bug
 import <optional>;  // bug
+import <vector>;
 import util.io;
 
 auto object(std::string_view& s) {
   return sequence<is_alnum>(s, "object name");
 }
 
+struct orbit {
+  std::string_view parent, child;
+};
+
+scanner& operator>>(scanner& s, orbit& o) {
+  return s >> object(o.parent) >> exact(")") >> object(o.child) >> exact("\n");
+}
+
 constexpr int ord(char c) {
   return is_upper(c) ? c - 'A' : is_lower(c) ? c - 'a' + 26 : c - '0' + 52;
 }
@@ -27,9 +36,9 @@ int main(int argc, char* argv[]) {
   std::array<planet, 62 * 62 * 62> planets;
 
   // Read the input.
-  std::string_view a, b;
-  while (!scanner.done()) {
-    (scanner >> object(a) >> exact(")") >> object(b) >> exact("\n")).check_ok();
+  std::vector<orbit> orbits;
+  (scanner >> lines(orbits) >> scanner::end).check_ok();
+  for (auto [a, b] : orbits) {
     check(a.size() == 3);
     check(b.size() == 3);
     auto& x = planets[key(b)];
@@ -37,7 +46,6 @@ int main(int argc, char* argv[]) {
     x.exists = true;
     x.parent = key(a);
   }
-  (scanner >> scanner::end).check_ok();
 
   // Part 1: count all direct and indirect orbits.
   planets[key("COM")].exists = true;
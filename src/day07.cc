@@ -60,8 +60,7 @@ program::value_type part2(program::const_span source) {
 }
 
 int main(int argc, char* argv[]) {
-  program::buffer buffer;
-  auto source = program::load(init(argc, argv), buffer);
+  auto source = program::load_file(input_filename(argc, argv));
   std::cout << "part1 " << part1(source) << "\n"
             << "part2 " << part2(source) << "\n";
 }
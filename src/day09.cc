@@ -7,8 +7,7 @@ import util.io;
 import intcode;
 
 int main(int argc, char* argv[]) {
-  program::buffer buffer;
-  auto source = program::load(init(argc, argv), buffer);
+  auto source = program::load_file(input_filename(argc, argv));
 
   program::value_type output_buffer[100];
 
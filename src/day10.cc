@@ -5,6 +5,7 @@ import <optional>;  // bug
 import <numeric>;
 import <set>;
 import <span>;
+import <string_view>;
 import <vector>;
 import util.io;
 import util.vec2;
@@ -22,21 +23,29 @@ bool unobstructed(vec2b a, vec2b b, const std::set<vec2b>& asteroids) {
   return true;
 }
 
-int main(int argc, char* argv[]) {
-  auto input = init(argc, argv);
-  std::set<vec2b> asteroids;
-  vec2b position = {};
-  for (char c : input) {
-    if (c == '#') {
-      asteroids.insert(position);
-    }
-    if (c == '\n') {
-      position.y++;
-      position.x = 0;
-    } else {
-      position.x++;
+// The positions of the asteroids, reusing the parsed form from previous runs.
+std::span<const vec2b> load_asteroids(const char* filename) {
+  return cached<vec2b>(filename, 1, [](std::string_view input) {
+    std::vector<vec2b> asteroids;
+    vec2b position = {};
+    for (char c : input) {
+      if (c == '#') {
+        asteroids.push_back(position);
+      }
+      if (c == '\n') {
+        position.y++;
+        position.x = 0;
+      } else {
+        position.x++;
+      }
     }
-  }
+    return asteroids;
+  });
+}
+
+int main(int argc, char* argv[]) {
+  const auto positions = load_asteroids(input_filename(argc, argv));
+  const std::set<vec2b> asteroids(positions.begin(), positions.end());
   int count = 0;
   vec2b station;
   for (auto a : asteroids) {
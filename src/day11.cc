@@ -68,8 +68,7 @@ struct robot {
 };
 
 int main(int argc, char* argv[]) {
-  program::buffer buffer;
-  const auto source = program::load(init(argc, argv), buffer);
+  const auto source = program::load_file(input_filename(argc, argv));
 
   robot robot;
   robot.run(source);
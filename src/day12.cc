@@ -8,6 +8,7 @@ import <unordered_set>;
 import <span>;  // bug
 import <string_view>;  // bug
 import <type_traits>;  // bug
+import util.grammar;
 import util.io;
 import util.vec3;
 
@@ -19,9 +20,12 @@ constexpr bool operator<(moon a, moon b) {
   return a.velocity < b.velocity;
 }
 
+constexpr auto position = grammar(
+    literal("<x="), field<&vec3i::x>(), literal(", y="), field<&vec3i::y>(),
+    literal(", z="), field<&vec3i::z>(), literal(">"));
+
 scanner& operator>>(scanner& s, moon& m) {
-  return s >> exact("<x=") >> m.position.x >> exact(", y=") >> m.position.y >>
-         exact(", z=") >> m.position.z >> exact(">");
+  return s >> position(m.position);
 }
 
 constexpr auto sign(int x) { return x < 0 ? -1 : x > 0 ? 1 : 0; }
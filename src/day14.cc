@@ -4,6 +4,7 @@ import <iostream>;
 import <map>;
 import <numeric>;
 import <string_view>;
+import util.grammar;
 import util.io;
 
 struct reaction {
@@ -15,21 +16,33 @@ struct reaction {
   int stage = 0;
 };
 
-auto element(std::string_view& out) {
-  return sequence<is_alpha>(out, "element name");
-}
+struct term {
+  int quantity;
+  std::string_view type;
+};
+
+constexpr auto first_input = grammar(
+    field<&term::quantity>(), word<&term::type, is_alpha>("element name"));
+constexpr auto next_input = grammar(
+    literal(","), field<&term::quantity>(),
+    word<&term::type, is_alpha>("element name"));
+constexpr auto output = grammar(
+    literal("=>"), field<&term::quantity>(),
+    word<&term::type, is_alpha>("element name"));
 
 scanner& operator>>(scanner& s, reaction& r) {
   r = {};
-  std::string_view type;
-  int quantity;
-  if (!(s >> quantity >> element(type))) return s;
-  r.requirements.emplace(type, quantity);
+  term t;
+  if (!(s >> first_input(t))) return s;
+  r.requirements.emplace(t.type, t.quantity);
   while (s.remaining().starts_with(',')) {
-    if (!(s >> exact(",") >> quantity >> element(type))) return s;
-    r.requirements.emplace(type, quantity);
+    if (!(s >> next_input(t))) return s;
+    r.requirements.emplace(t.type, t.quantity);
   }
-  return s >> exact("=>") >> r.output_quantity >> element(r.output_type);
+  if (!(s >> output(t))) return s;
+  r.output_quantity = t.quantity;
+  r.output_type = t.type;
+  return s;
 }
 
 // Populate reactions[name].stage and return the result.
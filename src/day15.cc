@@ -101,8 +101,7 @@ int max_distance(state initial) {
 }
 
 int main(int argc, char* argv[]) {
-  program::buffer buffer;
-  const auto source = program::load(init(argc, argv), buffer);
+  const auto source = program::load_file(input_filename(argc, argv));
 
   auto part1 = find_objective(source);
   std::cout << "part1 " << part1.distance_travelled << '\n';
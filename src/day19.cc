@@ -62,8 +62,7 @@ int part2(const program& program) {
 }
 
 int main(int argc, char* argv[]) {
-  program::buffer program_buffer;
-  const auto source = program::load(init(argc, argv), program_buffer);
+  const auto source = program::load_file(input_filename(argc, argv));
 
   std::cout << "part1 " << part1(program(source)) << '\n';
   std::cout << "part2 " << part2(program(source)) << '\n';
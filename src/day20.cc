@@ -28,9 +28,12 @@ void getline(scanner& s, std::span<char> out) {
 
 using vec2s = vec2<short>;
 
-// Find the positions of each portal with the given label.
-generator<vec2s> find(const grid<char>& grid, std::string_view label) {
+// Find the positions of each portal with the given label. Matches are
+// buffered so that the whole scan usually takes a single resume.
+batch_generator<vec2s> find(const grid<char>& grid, std::string_view label) {
   check(label.size() == 2);
+  vec2s found[8];
+  std::size_t count = 0;
   // Iterate over every cell searching for the first character of the label.
   for (short y = 0; y < grid_height; y++) {
     for (short x = 0; x < grid_width; x++) {
@@ -43,11 +46,17 @@ generator<vec2s> find(const grid<char>& grid, std::string_view label) {
         if (p2.x < grid_width && p2.y < grid_height &&
             grid[p2.y][p2.x] == label[1]) {
           auto p0 = vec2s{x, y} - offset, p3 = vec2s{x, y} + 2 * offset;
-          co_yield p0.x >= 0 && p0.y >= 0 && grid[p0.y][p0.x] == '.' ? p0 : p3;
+          if (count == std::size(found)) {
+            co_yield std::span<const vec2s>(found, count);
+            count = 0;
+          }
+          found[count++] =
+              p0.x >= 0 && p0.y >= 0 && grid[p0.y][p0.x] == '.' ? p0 : p3;
         }
       }
     }
   }
+  co_yield std::span<const vec2s>(found, count);
 }
 
 // Find a label which has no counterpart.
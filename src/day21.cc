@@ -58,8 +58,7 @@ int part1(program::const_span source) { return run(source, jump_program); }
 int part2(program::const_span source) { return run(source, run_program); }
 
 int main(int argc, char* argv[]) {
-  program::buffer program_buffer;
-  const auto source = program::load(init(argc, argv), program_buffer);
+  const auto source = program::load_file(input_filename(argc, argv));
 
   std::cout << "part1 " << part1(source) << '\n';
   std::cout << "part2 " << part2(source) << '\n';
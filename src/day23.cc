@@ -94,8 +94,7 @@ int part2(std::array<computer, 50> network) {
 }
 
 int main(int argc, char* argv[]) {
-  program::buffer program_buffer;
-  const auto source = program::load(init(argc, argv), program_buffer);
+  const auto source = program::load_file(input_filename(argc, argv));
 
   std::array<computer, 50> network;
   for (int i = 0; i < 50; i++) {
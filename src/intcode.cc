@@ -141,6 +141,15 @@ export class program {
     return buffer.first(n);
   }
 
+  // Load a program from a file, reusing the parsed form from previous runs.
+  static const_span load_file(const char* filename) {
+    return cached<value_type>(filename, 1, [](std::string_view source) {
+      buffer buffer;
+      auto program = load(source, buffer);
+      return std::vector<value_type>(program.begin(), program.end());
+    });
+  }
+
   program() = default;
 
   explicit program(const_span source) {
@@ -1,20 +1,254 @@
 module;
 
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
 export module util.coroutine;
 
+import "check.h";
+import <algorithm>;
+import <atomic>;
+import <bit>;
 import <chrono>;
+import <cmath>;
+import <condition_variable>;
 import <coroutine>;
+import <deque>;
+import <exception>;
+import <functional>;
+import <iostream>;
+import <iterator>;
 import <memory>;
+import <mutex>;
 import <optional>;
+import <ranges>;
+import <span>;
 import <thread>;
+import <tuple>;
+import <type_traits>;
+import <utility>;
 import <vector>;
 
+// A move-only nullary callable with a fixed amount of inline storage. It never
+// allocates: callables which do not fit are rejected at compile time.
+// Coroutine handles are stored directly, without any type erasure, so
+// scheduling a coroutine to be resumed is as cheap as copying a pointer.
+export class inline_task {
+ public:
+  static constexpr std::size_t capacity = 4 * sizeof(void*);
+
+  constexpr inline_task() = default;
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, inline_task> &&
+                std::is_invocable_v<std::decay_t<F>&>>>
+  inline_task(F&& f) {
+    using type = std::decay_t<F>;
+    if constexpr (std::is_convertible_v<type, std::coroutine_handle<>>) {
+      coroutine_ = std::coroutine_handle<>(f).address();
+    } else {
+      static_assert(sizeof(type) <= capacity,
+                    "callable is too large for inline_task");
+      static_assert(alignof(type) <= alignof(std::max_align_t));
+      static_assert(std::is_nothrow_move_constructible_v<type>);
+      new (storage_) type(std::forward<F>(f));
+      ops_ = &ops_for<type>;
+    }
+  }
+
+  inline_task(const inline_task&) = delete;
+  inline_task& operator=(const inline_task&) = delete;
+
+  inline_task(inline_task&& other) noexcept { take(other); }
+  inline_task& operator=(inline_task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  ~inline_task() { reset(); }
+
+  explicit operator bool() const { return ops_ || coroutine_; }
+
+  void operator()() {
+    if (ops_) {
+      ops_->invoke(storage_);
+    } else {
+      assert(coroutine_);
+      std::coroutine_handle<>::from_address(coroutine_).resume();
+    }
+  }
+
+  // Returns the stored coroutine handle, if this task resumes a coroutine.
+  std::coroutine_handle<> coroutine() const {
+    return ops_ ? std::coroutine_handle<>()
+                : std::coroutine_handle<>::from_address(coroutine_);
+  }
+
+ private:
+  struct operations {
+    void (*invoke)(void* f);
+    // Move-construct into the first argument and destroy the second.
+    void (*relocate)(void* to, void* from);
+    void (*destroy)(void* f);
+  };
+
+  template <typename F>
+  static constexpr operations ops_for = {
+      [](void* f) { (*static_cast<F*>(f))(); },
+      [](void* to, void* from) {
+        new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+      },
+      [](void* f) { static_cast<F*>(f)->~F(); },
+  };
+
+  void take(inline_task& other) {
+    ops_ = std::exchange(other.ops_, nullptr);
+    coroutine_ = std::exchange(other.coroutine_, nullptr);
+    if (ops_) ops_->relocate(storage_, other.storage_);
+  }
+
+  void reset() {
+    if (ops_) ops_->destroy(storage_);
+    ops_ = nullptr;
+    coroutine_ = nullptr;
+  }
+
+  const operations* ops_ = nullptr;
+  void* coroutine_ = nullptr;
+  alignas(std::max_align_t) unsigned char storage_[capacity];
+};
+
+// A histogram of non-negative integers with log-linear buckets: values are
+// grouped by their highest set bit and then split linearly into 16 buckets,
+// so every bucket is within about 6% of the values it holds. Recording is
+// thread-safe.
+export class histogram {
+ public:
+  void record(std::uint64_t value) {
+    counts_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    auto max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value)) {}
+  }
+
+  std::uint64_t count() const { return count_.load(); }
+  std::uint64_t max() const { return max_.load(); }
+  double mean() const {
+    const auto n = count();
+    return n ? (double)sum_.load() / n : 0;
+  }
+
+  // An upper bound on the value at the given quantile, in [0, 1].
+  std::uint64_t quantile(double q) const {
+    const auto n = count();
+    if (n == 0) return 0;
+    const auto rank = std::max<std::uint64_t>(1, std::ceil(q * n));
+    std::uint64_t seen = 0;
+    for (int i = 0; i < num_buckets; i++) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank) return std::min(max(), lower_bound(i + 1) - 1);
+    }
+    return max();
+  }
+
+  void print(std::ostream& output) const {
+    output << "count=" << count() << " mean=" << (std::uint64_t)mean();
+    for (auto [name, q] : quantiles) {
+      output << ' ' << name << '=' << quantile(q);
+    }
+    output << " max=" << max();
+  }
+
+  // Summary statistics plus every non-empty bucket as [lower bound, count].
+  void print_json(std::ostream& output) const {
+    output << "{\"count\":" << count() << ",\"mean\":" << mean();
+    for (auto [name, q] : quantiles) {
+      output << ",\"" << name << "\":" << quantile(q);
+    }
+    output << ",\"max\":" << max() << ",\"buckets\":[";
+    const char* separator = "";
+    for (int i = 0; i < num_buckets; i++) {
+      const auto n = counts_[i].load(std::memory_order_relaxed);
+      if (n == 0) continue;
+      output << separator << '[' << lower_bound(i) << ',' << n << ']';
+      separator = ",";
+    }
+    output << "]}";
+  }
+
+ private:
+  static constexpr int sub_bits = 4, sub_buckets = 1 << sub_bits;
+  static constexpr int num_buckets = (64 - sub_bits + 1) * sub_buckets;
+  static constexpr std::pair<const char*, double> quantiles[] = {
+      {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+
+  static int bucket(std::uint64_t value) {
+    if (value < sub_buckets) return value;
+    const int exponent = 63 - __builtin_clzll(value);
+    const int shift = exponent - sub_bits;
+    return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+  }
+
+  // The smallest value which falls in the given bucket.
+  static std::uint64_t lower_bound(int bucket) {
+    if (bucket < sub_buckets) return bucket;
+    if (bucket >= num_buckets) return -1;
+    const int shift = bucket / sub_buckets - 1;
+    return (std::uint64_t)(sub_buckets + bucket % sub_buckets) << shift;
+  }
+
+  std::atomic<std::uint64_t> counts_[num_buckets] = {};
+  std::atomic<std::uint64_t> count_ = 0, sum_ = 0, max_ = 0;
+};
+
+// Statistics gathered by an instrumented executor. Times are in nanoseconds.
+export struct executor_stats {
+  // How late each task started relative to the time it was scheduled for.
+  histogram lag;
+  // How long each task ran for before returning or suspending.
+  histogram run_time;
+  // How many other tasks were ready to run when each task started. Tasks
+  // scheduled for later are not counted until they are due.
+  histogram queue_depth;
+
+  void print(std::ostream& output) const {
+    output << "lag (ns):      ";
+    lag.print(output);
+    output << "\nrun time (ns): ";
+    run_time.print(output);
+    output << "\nqueue depth:   ";
+    queue_depth.print(output);
+    output << '\n';
+  }
+
+  void print_json(std::ostream& output) const {
+    output << "{\"lag_ns\":";
+    lag.print_json(output);
+    output << ",\"run_time_ns\":";
+    run_time.print_json(output);
+    output << ",\"queue_depth\":";
+    queue_depth.print_json(output);
+    output << "}\n";
+  }
+};
+
 export class executor {
  public:
   using time_point = std::chrono::steady_clock::time_point;
-  using task = std::function<void()>;
+  using task = inline_task;
 
   virtual void schedule_at(time_point time, task f) = 0;
 
@@ -27,13 +261,41 @@ export class executor {
     schedule_at(std::chrono::steady_clock::now() + duration, std::move(f));
   }
 
+  // Record statistics about every task that runs from now on, or stop if
+  // stats is null. Tasks which were already scheduled are not all recorded.
+  // Workers read the pointer without synchronisation, so this must not be
+  // called while the executor is running.
+  void instrument(executor_stats* stats) { stats_ = stats; }
+
  protected:
+  struct timer {
+    time_point time;
+    task resume;
+    friend constexpr inline bool operator>(const timer& l, const timer& r) {
+      return l.time > r.time;
+    }
+  };
+
+  // Run a task which was scheduled for the given time, while queue_depth
+  // other tasks are waiting to run.
+  void run_task(timer& t, std::size_t queue_depth) {
+    if (!stats_) [[likely]] return t.resume();
+    const auto start = std::chrono::steady_clock::now();
+    stats_->lag.record(std::max(start - t.time, {}).count());
+    stats_->queue_depth.record(queue_depth);
+    t.resume();
+    stats_->run_time.record(
+        (std::chrono::steady_clock::now() - start).count());
+  }
+
   constexpr executor() = default;
   virtual ~executor() = default;
   executor(const executor&) = default;
   executor& operator=(const executor&) = default;
   executor(executor&&) = default;
   executor& operator=(executor&&) = default;
+
+  executor_stats* stats_ = nullptr;
 };
 
 export inline thread_local executor* current_executor;
@@ -50,38 +312,724 @@ export class [[nodiscard]] set_executor {
   executor* const prev_;
 };
 
-export class series_executor final : public executor {
+// A hierarchical timing wheel (Varghese and Lauck, "Hashed and Hierarchical
+// Timing Wheels"). Deadlines are rounded up to ticks of about a microsecond.
+// Each level has 256 slots and covers 256 times the range of the level below.
+// An item lives in the lowest level at which its deadline shares all higher
+// digits with the current time, and moves down a level each time the wheel
+// reaches its slot. Insertion is O(1). Each item is moved at most once per
+// level before it expires. Items more than about an hour away wait in an
+// overflow list.
+template <typename T>
+class timer_wheel {
  public:
-  struct work_item {
-    time_point time;
-    task resume;
-    friend constexpr inline bool operator>(const work_item& l,
-                                           const work_item& r) {
-      return l.time > r.time;
+  using clock = std::chrono::steady_clock;
+  using time_point = clock::time_point;
+
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+
+  void insert(time_point time, T value) {
+    size_++;
+    place(to_tick(time), std::move(value));
+  }
+
+  // Append every item whose deadline is no later than the given time to out.
+  void advance(time_point time, std::vector<T>& out) {
+    const auto ns = (time - base_).count();
+    const std::uint64_t target = ns < 0 ? 0 : ns >> tick_shift;
+    while (true) {
+      const auto next = next_event();
+      if (!next || *next > target) break;
+      now_ = *next;
+      if (now_ % (std::uint64_t{1} << (bits * levels)) == 0) {
+        std::swap(scratch_, overflow_);
+        for (auto& e : scratch_) place(e.tick, std::move(e.value));
+        scratch_.clear();
+      }
+      for (int level = levels - 1; level > 0; level--) {
+        if (now_ & ((std::uint64_t{1} << (bits * level)) - 1)) continue;
+        const int slot = digit(now_, level);
+        if (!occupied(level, slot)) continue;
+        occupancy_[level][slot / 64] &= ~(std::uint64_t{1} << slot % 64);
+        std::swap(scratch_, slots_[level][slot]);
+        for (auto& e : scratch_) place(e.tick, std::move(e.value));
+        scratch_.clear();
+      }
+      if (const int slot = digit(now_, 0); occupied(0, slot)) {
+        occupancy_[0][slot / 64] &= ~(std::uint64_t{1} << slot % 64);
+        for (auto& e : slots_[0][slot]) due_.push_back(std::move(e.value));
+        slots_[0][slot].clear();
+      }
     }
+    // There are no events between now_ and target, so it is safe to skip.
+    now_ = std::max(now_, target);
+    size_ -= due_.size();
+    for (auto& value : due_) out.push_back(std::move(value));
+    due_.clear();
+  }
+
+  // The earliest time at which advance() may have something to do.
+  time_point next_deadline() const {
+    if (!due_.empty()) return time_point::min();
+    const auto next = next_event();
+    if (!next) return time_point::max();
+    return base_ + std::chrono::nanoseconds(*next << tick_shift);
+  }
+
+ private:
+  static constexpr int tick_shift = 10, bits = 8, levels = 4;
+  static constexpr int num_slots = 1 << bits;
+
+  struct entry {
+    std::uint64_t tick;
+    T value;
   };
 
+  std::uint64_t to_tick(time_point time) const {
+    const auto ns = (time - base_).count();
+    if (ns <= 0) return 0;
+    return (ns + (1 << tick_shift) - 1) >> tick_shift;
+  }
+
+  static int digit(std::uint64_t tick, int level) {
+    return (tick >> (bits * level)) & (num_slots - 1);
+  }
+
+  bool occupied(int level, int slot) const {
+    return (occupancy_[level][slot / 64] >> slot % 64) & 1;
+  }
+
+  // The first occupied slot after the given one at the given level, or -1.
+  int next_occupied(int level, int after) const {
+    for (int slot = after + 1; slot < num_slots; slot = (slot | 63) + 1) {
+      const auto word = occupancy_[level][slot / 64] >> slot % 64;
+      if (word) return slot + __builtin_ctzll(word);
+    }
+    return -1;
+  }
+
+  void place(std::uint64_t tick, T value) {
+    if (tick <= now_) {
+      due_.push_back(std::move(value));
+      return;
+    }
+    const int level = (63 - __builtin_clzll(tick ^ now_)) / bits;
+    if (level >= levels) {
+      overflow_.push_back({tick, std::move(value)});
+      return;
+    }
+    const int slot = digit(tick, level);
+    occupancy_[level][slot / 64] |= std::uint64_t{1} << slot % 64;
+    slots_[level][slot].push_back({tick, std::move(value)});
+  }
+
+  // The next tick at which a slot expires or cascades.
+  std::optional<std::uint64_t> next_event() const {
+    std::optional<std::uint64_t> result;
+    for (int level = 0; level < levels; level++) {
+      const int slot = next_occupied(level, digit(now_, level));
+      if (slot < 0) continue;
+      const int shift = bits * level;
+      const auto span = std::uint64_t{1} << (shift + bits);
+      const auto tick = (now_ & ~(span - 1)) + (std::uint64_t(slot) << shift);
+      if (!result || tick < *result) result = tick;
+    }
+    if (!overflow_.empty()) {
+      const auto span = std::uint64_t{1} << (bits * levels);
+      const auto tick = (now_ & ~(span - 1)) + span;
+      if (!result || tick < *result) result = tick;
+    }
+    return result;
+  }
+
+  const time_point base_ = clock::now();
+  std::uint64_t now_ = 0;
+  std::size_t size_ = 0;
+  std::uint64_t occupancy_[levels][num_slots / 64] = {};
+  std::vector<entry> slots_[levels][num_slots];
+  std::vector<entry> overflow_, scratch_;
+  // Items which are due but have not yet been handed out by advance().
+  std::vector<T> due_;
+};
+
+// Sleep until the given time without rounding it to a coarser duration type.
+void sleep_until(std::chrono::steady_clock::time_point time) {
+  const auto ns = time.time_since_epoch() / std::chrono::nanoseconds(1);
+  const timespec deadline = {(time_t)(ns / 1'000'000'000),
+                             (long)(ns % 1'000'000'000)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                         nullptr) == EINTR) {}
+}
+
+export class series_executor final : public executor {
+ public:
   void schedule_at(time_point time, task f) override {
-    work_.push_back({time, std::move(f)});
-    std::push_heap(std::begin(work_), std::end(work_), std::greater());
+    timers_.insert(time, {time, std::move(f)});
   }
 
   void run() {
     set_executor set(this);
-    while (!work_.empty()) {
-      std::pop_heap(std::begin(work_), std::end(work_), std::greater());
-      auto item = std::move(work_.back());
-      work_.pop_back();
-      auto now = std::chrono::steady_clock::now();
-      std::this_thread::sleep_for(item.time - now);
-      item.resume();
+    std::vector<timer> due;
+    while (!timers_.empty()) {
+      timers_.advance(std::chrono::steady_clock::now(), due);
+      if (due.empty()) {
+        sleep_until(timers_.next_deadline());
+        continue;
+      }
+      // Anything scheduled by these tasks goes into the wheel, not into due.
+      for (std::size_t i = 0; i < due.size(); i++) {
+        run_task(due[i], due.size() - i - 1);
+      }
+      due.clear();
+    }
+  }
+
+ private:
+  timer_wheel<timer> timers_;
+};
+
+export class io_executor;
+
+// Reads or writes as much of a buffer as is available without blocking,
+// suspending until the file descriptor is ready if nothing is. The result is
+// the number of bytes transferred or -errno. The file descriptor must be in
+// non-blocking mode and must support epoll: pipes, sockets, eventfds, etc.
+// Only one read and one write may wait on a file descriptor at a time.
+export class [[nodiscard]] io_awaiter {
+ public:
+  bool await_ready() { return attempt(); }
+  void await_suspend(std::coroutine_handle<> handle);
+  std::ptrdiff_t await_resume() const { return result_; }
+
+ private:
+  friend class io_executor;
+  friend io_awaiter async_read(int fd, std::span<char> buffer);
+  friend io_awaiter async_write(int fd, std::span<const char> buffer);
+
+  io_awaiter(int fd, bool write, void* data, std::size_t size)
+      : fd_(fd), write_(write), data_(data), size_(size) {}
+
+  // Returns false if the operation would block.
+  bool attempt() {
+    while (true) {
+      const auto n = write_ ? ::write(fd_, data_, size_)
+                            : ::read(fd_, data_, size_);
+      if (n >= 0) {
+        result_ = n;
+        return true;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+      if (errno != EINTR) {
+        result_ = -errno;
+        return true;
+      }
+    }
+  }
+
+  int fd_;
+  bool write_;
+  void* data_;
+  std::size_t size_;
+  std::ptrdiff_t result_ = 0;
+  std::coroutine_handle<> handle_;
+};
+
+export io_awaiter async_read(int fd, std::span<char> buffer) {
+  return io_awaiter(fd, false, buffer.data(), buffer.size());
+}
+
+export io_awaiter async_write(int fd, std::span<const char> buffer) {
+  return io_awaiter(fd, true, (void*)buffer.data(), buffer.size());
+}
+
+// A single-threaded executor which multiplexes timers and I/O readiness with
+// epoll. The earliest timer deadline is programmed into a timerfd so that the
+// loop sleeps in one place whether it is waiting for a timer or for I/O.
+// Coroutines awaiting I/O must be running on the io_executor.
+export class io_executor final : public executor {
+ public:
+  io_executor()
+      : epoll_(epoll_create1(EPOLL_CLOEXEC)),
+        timer_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+    check(epoll_ >= 0);
+    check(timer_ >= 0);
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = timer_}};
+    check(epoll_ctl(epoll_, EPOLL_CTL_ADD, timer_, &event) == 0);
+  }
+
+  ~io_executor() {
+    close(timer_);
+    close(epoll_);
+  }
+
+  io_executor(const io_executor&) = delete;
+  io_executor& operator=(const io_executor&) = delete;
+
+  void schedule_at(time_point time, task f) override {
+    timers_.insert(time, {time, std::move(f)});
+  }
+
+  // Runs until there are no timers left and no coroutines waiting for I/O.
+  void run() {
+    set_executor set(this);
+    std::vector<timer> due;
+    epoll_event events[64];
+    while (!timers_.empty() || waiting_) {
+      timers_.advance(std::chrono::steady_clock::now(), due);
+      if (!due.empty()) {
+        for (std::size_t i = 0; i < due.size(); i++) {
+          run_task(due[i], due.size() - i - 1);
+        }
+        due.clear();
+        continue;
+      }
+      arm(timers_.next_deadline());
+      const int n = epoll_wait(epoll_, events, std::size(events), -1);
+      if (n < 0) {
+        check(errno == EINTR);
+        continue;
+      }
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == timer_) {
+          std::uint64_t expirations;
+          (void)::read(timer_, &expirations, sizeof(expirations));
+        } else {
+          ready(events[i].data.fd, events[i].events);
+        }
+      }
+    }
+    arm(time_point::max());
+  }
+
+ private:
+  friend class io_awaiter;
+
+  struct registration {
+    io_awaiter* reader = nullptr;
+    io_awaiter* writer = nullptr;
+  };
+
+  void wait(io_awaiter* operation) {
+    const int fd = operation->fd_;
+    if ((std::size_t)fd >= fds_.size()) fds_.resize(fd + 1);
+    auto& r = fds_[fd];
+    const bool registered = r.reader || r.writer;
+    auto& slot = operation->write_ ? r.writer : r.reader;
+    check(!slot);
+    slot = operation;
+    waiting_++;
+    update(fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+  }
+
+  void ready(int fd, std::uint32_t events) {
+    auto& r = fds_[fd];
+    // Errors and hangups wake both directions, and the retried operation
+    // reports them.
+    constexpr std::uint32_t failed = EPOLLERR | EPOLLHUP;
+    bool changed = false;
+    if (r.reader && (events & (EPOLLIN | failed)) && r.reader->attempt()) {
+      complete(std::exchange(r.reader, nullptr));
+      changed = true;
+    }
+    if (r.writer && (events & (EPOLLOUT | failed)) && r.writer->attempt()) {
+      complete(std::exchange(r.writer, nullptr));
+      changed = true;
+    }
+    if (!changed) return;
+    update(fd, r.reader || r.writer ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+  }
+
+  void complete(io_awaiter* operation) {
+    waiting_--;
+    schedule(operation->handle_);
+  }
+
+  void update(int fd, int op) {
+    const auto& r = fds_[fd];
+    epoll_event event = {
+        .events = (r.reader ? EPOLLIN : 0u) | (r.writer ? EPOLLOUT : 0u),
+        .data = {.fd = fd}};
+    check(epoll_ctl(epoll_, op, fd, &event) == 0);
+  }
+
+  // Program the timerfd to fire at the given time.
+  void arm(time_point time) {
+    if (time == armed_) return;
+    armed_ = time;
+    itimerspec spec = {};
+    if (time != time_point::max()) {
+      const auto ns = time.time_since_epoch() / std::chrono::nanoseconds(1);
+      // A zero expiry would disarm the timer instead.
+      spec.it_value = {(time_t)(ns / 1'000'000'000),
+                       std::max(1L, (long)(ns % 1'000'000'000))};
+    }
+    check(timerfd_settime(timer_, TFD_TIMER_ABSTIME, &spec, nullptr) == 0);
+  }
+
+  const int epoll_, timer_;
+  time_point armed_ = time_point::max();
+  timer_wheel<timer> timers_;
+  // Coroutines waiting for I/O, indexed by file descriptor.
+  std::vector<registration> fds_;
+  int waiting_ = 0;
+};
+
+void io_awaiter::await_suspend(std::coroutine_handle<> handle) {
+  handle_ = handle;
+  auto* io = dynamic_cast<io_executor*>(current_executor);
+  check(io);
+  io->wait(this);
+}
+
+// A lock-free work-stealing deque (Chase and Lev, "Dynamic Circular
+// Work-Stealing Deque", using the memory orderings from Le et al., "Correct
+// and Efficient Work-Stealing for Weak Memory Models"). The owning thread
+// pushes and pops at the bottom while any other thread may steal from the top.
+template <typename T>
+class work_deque {
+ public:
+  work_deque() {
+    arrays_.push_back(std::make_unique<array>(64));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+  }
+
+  // Owner only.
+  void push(T x) {
+    const auto bottom = bottom_.load(std::memory_order_relaxed);
+    const auto top = top_.load(std::memory_order_acquire);
+    array* a = array_.load(std::memory_order_relaxed);
+    if (bottom - top > a->capacity - 1) a = grow(a, top, bottom);
+    a->put(bottom, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only.
+  std::optional<T> pop() {
+    const auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      // The deque was empty.
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return std::nullopt;
+    }
+    std::optional<T> result = a->get(bottom);
+    if (top == bottom) {
+      // This is the last item, so we are racing against thieves for it.
+      if (!top_.compare_exchange_strong(top, top + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        result.reset();
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  // Any thread.
+  std::optional<T> steal() {
+    auto top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) return std::nullopt;
+    const T result = array_.load(std::memory_order_acquire)->get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return std::nullopt;
     }
+    return result;
   }
 
  private:
+  struct array {
+    explicit array(std::int64_t capacity)
+        : capacity(capacity), slots(new std::atomic<T>[capacity]) {}
+    T get(std::int64_t i) const {
+      return slots[i & (capacity - 1)].load(std::memory_order_acquire);
+    }
+    void put(std::int64_t i, T x) {
+      slots[i & (capacity - 1)].store(x, std::memory_order_release);
+    }
+    const std::int64_t capacity;
+    const std::unique_ptr<std::atomic<T>[]> slots;
+  };
+
+  array* grow(array* a, std::int64_t top, std::int64_t bottom) {
+    auto bigger = std::make_unique<array>(2 * a->capacity);
+    for (auto i = top; i != bottom; i++) bigger->put(i, a->get(i));
+    array_.store(bigger.get(), std::memory_order_release);
+    // Thieves may still be reading from the old array, so it is kept alive
+    // until the deque is destroyed.
+    arrays_.push_back(std::move(bigger));
+    return arrays_.back().get();
+  }
+
+  alignas(64) std::atomic<std::int64_t> top_ = 0;
+  alignas(64) std::atomic<std::int64_t> bottom_ = 0;
+  std::atomic<array*> array_;
+  std::vector<std::unique_ptr<array>> arrays_;
+};
+
+// Per-thread free lists of coroutine frames, and of the boxes which
+// thread_pool_executor puts other tasks in, bucketed by size in powers of
+// two. Blocks which are freed on a different thread from the one that
+// allocated them simply migrate to the other thread's lists.
+class frame_pool {
+ public:
+  frame_pool() = default;
+  frame_pool(const frame_pool&) = delete;
+  frame_pool& operator=(const frame_pool&) = delete;
+
+  ~frame_pool() {
+    for (node* n : free_) {
+      while (n) ::operator delete(std::exchange(n, n->next));
+    }
+  }
+
+  void* allocate(std::size_t size) {
+    const int b = bucket(size);
+    if (b >= num_buckets) return ::operator new(size);
+    if (node* n = free_[b]) {
+      free_[b] = n->next;
+      count_[b]--;
+      return n;
+    }
+    return ::operator new(std::size_t{1} << (b + min_shift));
+  }
+
+  void deallocate(void* frame, std::size_t size) {
+    const int b = bucket(size);
+    if (b >= num_buckets || count_[b] == max_cached) {
+      ::operator delete(frame);
+      return;
+    }
+    free_[b] = new (frame) node{free_[b]};
+    count_[b]++;
+  }
+
+ private:
+  struct node { node* next; };
+  static constexpr int min_shift = 6, num_buckets = 16, max_cached = 64;
+
+  static int bucket(std::size_t size) {
+    if (size <= std::size_t{1} << min_shift) return 0;
+    return 64 - __builtin_clzll(size - 1) - min_shift;
+  }
+
+  node* free_[num_buckets] = {};
+  int count_[num_buckets] = {};
+};
+
+inline thread_local frame_pool frames;
+
+// Runs work on a fixed set of threads. Each worker has its own deque of
+// ready work and steals from a random other worker when it runs out. Work
+// scheduled for the future, or from outside the pool, goes into a shared
+// timer heap which workers drain into their own deques when they are idle,
+// and periodically while they are busy so that it does not starve.
+export class thread_pool_executor final : public executor {
+ public:
+  explicit thread_pool_executor(
+      int num_threads = std::thread::hardware_concurrency())
+      : num_workers_(std::max(num_threads, 1)),
+        workers_(new worker[num_workers_]) {}
+
+  void schedule_at(time_point time, task f) override {
+    pending_.fetch_add(1);
+    if (current_pool_ == this && time <= std::chrono::steady_clock::now()) {
+      push(workers_[current_index_].deque, {time, std::move(f)});
+      notify();
+    } else {
+      std::lock_guard lock(mutex_);
+      timers_.push_back({time, std::move(f)});
+      std::push_heap(std::begin(timers_), std::end(timers_), std::greater());
+      update_next_due();
+      epoch_.fetch_add(1);
+      condition_.notify_one();
+    }
+  }
+
+  // Run until there is no work left, using the calling thread as one of the
+  // workers.
+  void run() {
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_workers_; i++) {
+      threads.emplace_back([this, i] { work(i); });
+    }
+    work(0);
+    for (auto& thread : threads) thread.join();
+  }
+
+ private:
+  // Items in the deques are single words so that they can be exchanged
+  // atomically. Coroutines are stored as their frame address and any other
+  // task is boxed, with the low bit set to tell the two apart. Boxes come from
+  // the per-thread frame pools, so a busy pool recycles them rather than
+  // going to the heap. While the executor is instrumented, everything is
+  // boxed to keep the schedule time.
+  using item = void*;
+
+  struct box_deleter {
+    void operator()(timer* t) const {
+      t->~timer();
+      frames.deallocate(t, sizeof(timer));
+    }
+  };
+
+  item to_item(timer t) {
+    if (!stats_) {
+      if (auto handle = t.resume.coroutine()) return handle.address();
+    }
+    timer* box = new (frames.allocate(sizeof(timer))) timer(std::move(t));
+    return (item)((std::uintptr_t)box | 1);
+  }
+
+  void invoke(item i) {
+    if ((std::uintptr_t)i & 1) {
+      std::unique_ptr<timer, box_deleter> t(
+          (timer*)((std::uintptr_t)i & ~std::uintptr_t{1}));
+      run_task(*t, ready_.fetch_sub(1, std::memory_order_relaxed) - 1);
+    } else {
+      std::coroutine_handle<>::from_address(i).resume();
+    }
+  }
+
+  struct worker {
+    work_deque<item> deque;
+  };
+
+  void push(work_deque<item>& deque, timer t) {
+    if (stats_) ready_.fetch_add(1, std::memory_order_relaxed);
+    deque.push(to_item(std::move(t)));
+  }
+
+  // Wake an idle worker, if there is one, to pick up new work.
+  void notify() {
+    epoch_.fetch_add(1);
+    if (idle_.load() > 0) {
+      std::lock_guard lock(mutex_);
+      condition_.notify_one();
+    }
+  }
+
+  item find_work(int index, std::uint64_t& random) {
+    if (auto item = workers_[index].deque.pop()) return *item;
+    // Try to steal from every other worker, starting at a random one.
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    const int start = random % num_workers_;
+    for (int i = 0; i < num_workers_; i++) {
+      const int victim = (start + i) % num_workers_;
+      if (victim == index) continue;
+      if (auto item = workers_[victim].deque.steal()) return *item;
+    }
+    return nullptr;
+  }
+
+  // Move all due timers into the given deque. Requires mutex_.
+  bool take_due_timers(work_deque<item>& deque) {
+    const auto now = std::chrono::steady_clock::now();
+    int count = 0;
+    while (!timers_.empty() && timers_.front().time <= now) {
+      std::pop_heap(std::begin(timers_), std::end(timers_), std::greater());
+      push(deque, std::move(timers_.back()));
+      timers_.pop_back();
+      count++;
+    }
+    update_next_due();
+    if (count > 1) {
+      epoch_.fetch_add(1);
+      condition_.notify_all();
+    }
+    return count > 0;
+  }
+
+  // Requires mutex_.
+  void update_next_due() {
+    next_due_.store(timers_.empty() ? time_point::max()
+                                    : timers_.front().time,
+                    std::memory_order_relaxed);
+  }
+
+  bool timers_due() const {
+    return next_due_.load(std::memory_order_relaxed) <=
+           std::chrono::steady_clock::now();
+  }
+
+  void run_item(item i) {
+    invoke(i);
+    if (pending_.fetch_sub(1) == 1) {
+      // That was the last piece of work: wake everyone so they can exit.
+      std::lock_guard lock(mutex_);
+      condition_.notify_all();
+    }
+  }
 
-  // Work items in heap order.
-  std::vector<work_item> work_;
+  void work(int index) {
+    set_executor set(this);
+    auto* const previous_pool = std::exchange(current_pool_, this);
+    const int previous_index = std::exchange(current_index_, index);
+    std::uint64_t random = 0x9e3779b97f4a7c15 * (index + 1);
+    int since_timers = 0;
+    while (pending_.load() != 0) {
+      const auto epoch = epoch_.load();
+      if (item i = find_work(index, random)) {
+        run_item(i);
+        if (++since_timers == timer_interval) {
+          since_timers = 0;
+          if (timers_due()) {
+            std::lock_guard lock(mutex_);
+            take_due_timers(workers_[index].deque);
+          }
+        }
+        continue;
+      }
+      std::unique_lock lock(mutex_);
+      if (take_due_timers(workers_[index].deque)) continue;
+      if (pending_.load() == 0) break;
+      // Sleep until there is new work or the next timer is due. Checking the
+      // epoch after announcing that we are idle guarantees that we either see
+      // any work published concurrently or get woken up for it.
+      idle_.fetch_add(1);
+      if (epoch_.load() == epoch) {
+        if (timers_.empty()) {
+          condition_.wait(lock);
+        } else {
+          condition_.wait_until(lock, timers_.front().time);
+        }
+      }
+      idle_.fetch_sub(1);
+    }
+    current_pool_ = previous_pool;
+    current_index_ = previous_index;
+  }
+
+  // How many items a busy worker runs between checks for due timers.
+  static constexpr int timer_interval = 32;
+
+  static inline thread_local thread_pool_executor* current_pool_ = nullptr;
+  static inline thread_local int current_index_ = 0;
+
+  const int num_workers_;
+  const std::unique_ptr<worker[]> workers_;
+  // Number of tasks which have been scheduled but have not finished running.
+  std::atomic<std::int64_t> pending_ = 0;
+  // Number of items in the deques, counted only while instrumented.
+  std::atomic<std::int64_t> ready_ = 0;
+  // Incremented whenever new work is published.
+  std::atomic<std::uint64_t> epoch_ = 0;
+  std::atomic<int> idle_ = 0;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  // Work items in heap order. Guarded by mutex_.
+  std::vector<timer> timers_;
+  // The time of the earliest item in timers_, readable without the lock.
+  std::atomic<time_point> next_due_ = time_point::max();
 };
 
 export class time_awaiter {
@@ -94,8 +1042,7 @@ export class time_awaiter {
   constexpr void await_resume() const {}
 
   void await_suspend(std::coroutine_handle<> handle) {
-    current_executor->schedule_at(
-        time_, [handle = std::move(handle)]() mutable { handle.resume(); });
+    current_executor->schedule_at(time_, handle);
   }
 
  private:
@@ -113,66 +1060,375 @@ constexpr inline auto operator co_await(
   return time_awaiter{std::chrono::steady_clock::now() + duration};
 }
 
+// The result of an eagerly started coroutine, which can be awaited once. The
+// result lives in the coroutine frame, so starting a coroutine costs exactly
+// one allocation. Ownership of the frame is shared between the promise and
+// the running coroutine: whichever finishes with it last destroys it, so a
+// promise may be discarded to run the coroutine in the background.
+// Exceptions are rethrown by the await, or terminate the program if the
+// promise was discarded.
 export template <typename T>
 class promise {
- private:
-  struct result {
-    void wait(std::coroutine_handle<> handle) {
-      if (contents) {
-        handle.resume();
-      } else {
-        reader = std::move(handle);
-      }
-    }
-
-    std::optional<T> contents;
-    std::coroutine_handle<> reader;
-  };
-
  public:
+  struct promise_type;
+  using handle = std::coroutine_handle<promise_type>;
+
   constexpr promise() = default;
+  ~promise() { release(); }
+
+  // Non-copyable.
+  promise(const promise&) = delete;
+  promise& operator=(const promise&) = delete;
+
+  // Movable.
+  promise(promise&& other) : handle_(std::exchange(other.handle_, {})) {}
+  promise& operator=(promise&& other) {
+    release();
+    handle_ = std::exchange(other.handle_, {});
+    return *this;
+  }
 
   // Coroutine await.
-  constexpr bool await_ready() const { return result_->contents.has_value(); }
-  constexpr T await_resume() const& { return std::move(*result_->contents); }
-  void await_suspend(std::coroutine_handle<> handle) const {
-    if (result_->contents) {
-      handle.resume();
-    } else {
-      result_->reader = std::move(handle);
-    }
+  bool await_ready() const {
+    return handle_.promise().state.load(std::memory_order_acquire) == done();
+  }
+  T await_resume() const {
+    auto& p = handle_.promise();
+    p.observed = true;
+    if (p.exception) std::rethrow_exception(p.exception);
+    return std::move(*p.result);
+  }
+  bool await_suspend(std::coroutine_handle<> reader) const {
+    // If the coroutine finishes first, resume the reader immediately.
+    void* expected = nullptr;
+    return handle_.promise().state.compare_exchange_strong(
+        expected, reader.address(), std::memory_order_acq_rel);
   }
 
   // Coroutine promise type.
-  struct promise_type;
-  using handle = std::coroutine_handle<promise_type>;
   struct promise_type {
-    constexpr auto get_return_object() { return promise{result}; }
+    promise get_return_object() {
+      return promise{handle::from_promise(*this)};
+    }
 
     constexpr auto initial_suspend() {
       return std::suspend_never{};
     }
 
-    constexpr auto final_suspend() noexcept {
-      return std::suspend_always{};
-    }
+    constexpr auto final_suspend() noexcept {
+      return final_awaiter{};
+    }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    template <typename U,
+              typename = std::enable_if_t<std::is_constructible_v<T, U>>>
+    constexpr void return_value(U&& value) {
+      result.emplace(std::forward<U>(value));
+    }
+
+    std::optional<T> result;
+    std::exception_ptr exception;
+    // Set once the result (or exception) has been handed to a reader.
+    bool observed = false;
+    // nullptr while running, the address of the reader once there is one,
+    // or one of done() and detached().
+    std::atomic<void*> state = nullptr;
+  };
+
+ private:
+  static inline char done_tag, detached_tag;
+  static void* done() { return &done_tag; }
+  static void* detached() { return &detached_tag; }
+
+  struct final_awaiter {
+    constexpr bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(handle self) noexcept {
+      void* previous =
+          self.promise().state.exchange(done(), std::memory_order_acq_rel);
+      if (previous == detached()) {
+        // Nobody is left to observe the exception.
+        if (self.promise().exception) std::terminate();
+        self.destroy();
+        return std::noop_coroutine();
+      }
+      // Transfer control directly to the reader, if there is one, so that
+      // long chains of awaits run in constant stack space.
+      if (previous) return std::coroutine_handle<>::from_address(previous);
+      return std::noop_coroutine();
+    }
+    constexpr void await_resume() noexcept {}
+  };
+
+  explicit promise(handle handle) : handle_(std::move(handle)) {}
+
+  void release() {
+    if (!handle_) return;
+    if (handle_.promise().state.exchange(detached(),
+                                         std::memory_order_acq_rel) == done()) {
+      // As in final_awaiter, an exception which nobody saw is fatal.
+      auto& p = handle_.promise();
+      if (p.exception && !p.observed) std::terminate();
+      handle_.destroy();
+    }
+    handle_ = {};
+  }
+
+  handle handle_ = {};
+};
+
+// Awaits a promise without throwing, recording the first exception instead.
+template <typename T>
+class settle_awaiter {
+ public:
+  settle_awaiter(promise<T>& task, std::exception_ptr& error)
+      : task_(task), error_(error) {}
+
+  bool await_ready() const { return task_.await_ready(); }
+  bool await_suspend(std::coroutine_handle<> reader) const {
+    return task_.await_suspend(reader);
+  }
+  std::optional<T> await_resume() const {
+    try {
+      return task_.await_resume();
+    } catch (...) {
+      if (!error_) error_ = std::current_exception();
+      return std::nullopt;
+    }
+  }
+
+ private:
+  promise<T>& task_;
+  std::exception_ptr& error_;
+};
+
+// Waits for all of the given coroutines to finish and returns their results.
+// If any of them throw, the first exception (in argument order) is rethrown
+// once all of them have finished.
+export template <typename... Ts>
+promise<std::tuple<Ts...>> when_all(promise<Ts>... tasks) {
+  std::exception_ptr error;
+  // Braced initializers are evaluated left to right.
+  std::tuple<std::optional<Ts>...> results{
+      co_await settle_awaiter<Ts>(tasks, error)...};
+  if (error) std::rethrow_exception(error);
+  co_return std::apply(
+      [](auto&... result) { return std::tuple<Ts...>(std::move(*result)...); },
+      results);
+}
+
+// A set of tasks which are scheduled on an executor and awaited together:
+//
+//   task_group group;
+//   for (int i = 0; i < n; i++) group.spawn([i] { ... });
+//   co_await group.wait();
+//
+// Tasks may be plain functions or functions which start a coroutine and
+// return its promise. The first exception thrown by any task cancels the
+// group and is rethrown by wait(). Cancellation is cooperative: tasks which
+// have not started yet are skipped, and running tasks can poll cancelled().
+// The group must be awaited before it is destroyed.
+export class task_group {
+ public:
+  explicit task_group(executor* executor = current_executor)
+      : executor_(executor) {
+    assert(executor_);
+  }
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  ~task_group() { assert(pending_.load() == 0); }
+
+  template <typename F>
+  void spawn(F f) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    executor_->schedule([this, f = std::move(f)]() mutable { run(f); });
+  }
+
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+  class [[nodiscard]] wait_awaiter {
+   public:
+    constexpr bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> waiter) const {
+      group_.waiter_ = waiter;
+      group_.waiter_executor_ = current_executor;
+      // Drop the reference held by wait() itself. If every task has already
+      // finished, there is nobody left to resume us.
+      return group_.pending_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+    void await_resume() const {
+      if (group_.error_) std::rethrow_exception(group_.error_);
+    }
+
+   private:
+    friend class task_group;
+    explicit wait_awaiter(task_group& group) : group_(group) {}
+    task_group& group_;
+  };
+
+  // Waits for every spawned task to finish. May only be awaited once.
+  wait_awaiter wait() { return wait_awaiter(*this); }
+
+ private:
+  template <typename F>
+  void run(F& f) {
+    if (cancelled()) return finish();
+    try {
+      if constexpr (std::is_void_v<std::invoke_result_t<F&>>) {
+        f();
+      } else {
+        join(f());
+        return;
+      }
+    } catch (...) {
+      fail();
+    }
+    finish();
+  }
+
+  template <typename T>
+  promise<bool> join(promise<T> task) {
+    try {
+      co_await task;
+    } catch (...) {
+      fail();
+    }
+    finish();
+    co_return true;
+  }
+
+  void fail() {
+    std::lock_guard lock(mutex_);
+    if (!error_) error_ = std::current_exception();
+    cancel();
+  }
+
+  void finish() {
+    if (pending_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    waiter_executor_->schedule(waiter_);
+  }
+
+  executor* const executor_;
+  // The number of unfinished tasks, plus one until wait() suspends.
+  std::atomic<int> pending_ = 1;
+  std::atomic<bool> cancelled_ = false;
+  std::mutex mutex_;
+  std::exception_ptr error_;  // Guarded by mutex_.
+  std::coroutine_handle<> waiter_;
+  executor* waiter_executor_ = nullptr;
+};
+
+template <typename Range, typename Body>
+promise<bool> parallel_for_impl(Range range, std::size_t grain, Body body) {
+  // Chunks refer to shared state so that they fit within an inline_task.
+  task_group group;
+  struct state {
+    task_group& group;
+    std::ranges::iterator_t<Range> first;
+    std::size_t size, grain;
+    Body& body;
+  } s{group, std::ranges::begin(range), std::ranges::size(range), grain, body};
+  for (std::size_t i = 0; i < s.size; i += grain) {
+    s.group.spawn([&s, i] {
+      const std::size_t end = std::min(s.size, i + s.grain);
+      for (std::size_t j = i; j < end && !s.group.cancelled(); j++) {
+        s.body(s.first[j]);
+      }
+    });
+  }
+  co_await s.group.wait();
+  co_return true;
+}
+
+// Calls body on each element of the range, in chunks of `grain` elements
+// scheduled on the current executor. Await the result to wait for completion.
+export template <std::ranges::random_access_range Range, typename Body>
+  requires std::ranges::sized_range<Range>
+promise<bool> parallel_for(Range&& range, std::size_t grain, Body body) {
+  return parallel_for_impl(std::views::all(std::forward<Range>(range)),
+                           std::max<std::size_t>(grain, 1), std::move(body));
+}
+
+// A caller-supplied buffer for coroutine frames. Frames are allocated from
+// the top of the buffer and released in LIFO order, which suits coroutines
+// that are created and destroyed one after another in a loop. A coroutine
+// uses the arena if its first parameter is a frame_arena&. If the arena is
+// full, frames fall back to the thread-local frame pool.
+export class frame_arena {
+ public:
+  // The start of the buffer is skipped up to the frame alignment, if need be.
+  explicit frame_arena(std::span<std::byte> buffer)
+      : top_(buffer.data() +
+             std::min(round_up((std::uintptr_t)buffer.data()) -
+                          (std::uintptr_t)buffer.data(),
+                      buffer.size())),
+        end_(buffer.data() + buffer.size()) {}
+
+  frame_arena(const frame_arena&) = delete;
+  frame_arena& operator=(const frame_arena&) = delete;
+
+  void* allocate(std::size_t size) {
+    size = round_up(size);
+    if ((std::size_t)(end_ - top_) < size) return nullptr;
+    return std::exchange(top_, top_ + size);
+  }
+
+  void deallocate(void* frame, std::size_t size) {
+    // Space is only reclaimed if this was the most recent allocation.
+    if ((std::byte*)frame + round_up(size) == top_) top_ = (std::byte*)frame;
+  }
+
+ private:
+  static constexpr std::size_t round_up(std::size_t size) {
+    constexpr std::size_t alignment = alignof(std::max_align_t);
+    return (size + alignment - 1) & ~(alignment - 1);
+  }
+
+  std::byte* top_;
+  std::byte* const end_;
+};
 
-    constexpr void unhandled_exception() { std::terminate(); }
+// Each frame is preceded by a header recording where it came from.
+struct alignas(std::max_align_t) frame_header {
+  frame_arena* arena;
+};
 
-    template <typename U,
-              typename = std::enable_if_t<std::is_constructible_v<T, U>>>
-    constexpr void return_value(U&& value) {
-      result->contents.emplace(std::forward<U>(value));
-      if (result->reader) result->reader.resume();
-    }
+void* allocate_frame(std::size_t size, frame_arena* arena) {
+  const std::size_t total = sizeof(frame_header) + size;
+  void* memory = arena ? arena->allocate(total) : nullptr;
+  if (!memory) {
+    arena = nullptr;
+    memory = frames.allocate(total);
+  }
+  return new (memory) frame_header{arena} + 1;
+}
 
-    std::shared_ptr<result> result = std::make_shared<promise::result>();
-  };
+void deallocate_frame(void* frame, std::size_t size) {
+  auto* header = static_cast<frame_header*>(frame) - 1;
+  const std::size_t total = sizeof(frame_header) + size;
+  if (header->arena) {
+    header->arena->deallocate(header, total);
+  } else {
+    frames.deallocate(header, total);
+  }
+}
 
- private:
-  explicit promise(std::shared_ptr<result> result)
-      : result_(std::move(result)) {}
-  std::shared_ptr<result> result_;
+// Frames come from a thread-local pool, or from a frame_arena passed as the
+// first argument to the coroutine.
+struct pooled_frame {
+  static void* operator new(std::size_t size) {
+    return allocate_frame(size, nullptr);
+  }
+  template <typename... Args>
+  static void* operator new(std::size_t size, frame_arena& arena, Args&...) {
+    return allocate_frame(size, &arena);
+  }
+  static void operator delete(void* frame, std::size_t size) {
+    deallocate_frame(frame, size);
+  }
 };
 
 export template <typename T>
@@ -197,7 +1453,7 @@ class generator {
 
   struct promise_type;
   using handle = std::coroutine_handle<promise_type>;
-  struct promise_type {
+  struct promise_type : pooled_frame {
     constexpr auto get_return_object() {
       return generator{handle::from_promise(*this)};
     }
@@ -280,3 +1536,631 @@ class generator {
 
   handle handle_ = {};
 };
+
+// A generator which produces its elements in batches: the coroutine yields a
+// span of elements and is only resumed once the consumer has seen all of them.
+// The span must remain valid until the coroutine is resumed, which is the
+// case for a buffer that lives in the coroutine frame. From the outside it
+// behaves like a generator<T> of individual elements.
+export template <typename T>
+class batch_generator {
+ public:
+  constexpr batch_generator() = default;
+  ~batch_generator() { if (handle_) handle_.destroy(); }
+
+  // Non-copyable.
+  batch_generator(const batch_generator&) = delete;
+  batch_generator& operator=(const batch_generator&) = delete;
+
+  // Movable.
+  constexpr batch_generator(batch_generator&& other)
+      : handle_(std::exchange(other.handle_, {})),
+        index_(std::exchange(other.index_, 0)) {}
+  constexpr batch_generator& operator=(batch_generator&& other) {
+    if (handle_) handle_.destroy();
+    handle_ = std::exchange(other.handle_, {});
+    index_ = std::exchange(other.index_, 0);
+    return *this;
+  }
+
+  struct promise_type;
+  using handle = std::coroutine_handle<promise_type>;
+  struct promise_type : pooled_frame {
+    constexpr auto get_return_object() {
+      return batch_generator{handle::from_promise(*this)};
+    }
+
+    constexpr auto initial_suspend() {
+      return std::suspend_always{};
+    }
+
+    constexpr auto final_suspend() noexcept {
+      return std::suspend_always{};
+    }
+
+    constexpr void unhandled_exception() {
+      std::rethrow_exception(std::current_exception());
+    }
+
+    constexpr auto yield_value(std::span<const T> values) {
+      batch = values;
+      return std::suspend_always{};
+    }
+
+    constexpr void return_void() {}
+
+    std::span<const T> batch;
+  };
+
+  constexpr bool done() { return handle_.done(); }
+
+  constexpr const T& value() const {
+    assert(!handle_.done());
+    return handle_.promise().batch[index_];
+  }
+
+  constexpr void next() { advance(handle_, index_); }
+
+  class sentinel {};
+
+  class iterator {
+   public:
+    iterator(const iterator&) = delete;
+    iterator& operator=(const iterator&) = delete;
+    iterator(iterator&& other)
+        : handle_(std::exchange(other.handle_, {})), index_(other.index_) {}
+    ~iterator() { if (handle_) handle_.destroy(); }
+    const T& operator*() const { return handle_.promise().batch[index_]; }
+    const T* operator->() const { return &**this; }
+    iterator& operator++() {
+      advance(handle_, index_);
+      return *this;
+    }
+   private:
+    friend class batch_generator;
+    iterator(handle handle, std::size_t index)
+        : handle_(std::move(handle)), index_(index) {}
+
+    friend inline constexpr bool operator!=(const iterator& i, sentinel) {
+      return !i.handle_.done();
+    }
+
+    handle handle_;
+    std::size_t index_;
+  };
+
+  iterator begin() {
+    next();
+    return iterator(std::exchange(handle_, {}), index_);
+  }
+
+  sentinel end() { return {}; }
+
+ private:
+  explicit batch_generator(handle handle) : handle_(std::move(handle)) {}
+
+  // Move to the next element, resuming the coroutine only when the current
+  // batch is exhausted. Empty batches are skipped.
+  static void advance(handle h, std::size_t& index) {
+    assert(!h.done());
+    if (index + 1 < h.promise().batch.size()) {
+      index++;
+      return;
+    }
+    index = 0;
+    do {
+      h.resume();
+    } while (!h.done() && h.promise().batch.empty());
+  }
+
+  handle handle_ = {};
+  std::size_t index_ = 0;
+};
+
+// Lazy adaptors which compose with generators (or any other range) using |:
+//
+//   for (int x : numbers() | filter(is_even) | transform(square)) ...
+//
+// Each stage wraps the iterator of the stage before it, so the whole pipeline
+// compiles down to a single loop around the source, resuming the underlying
+// generator once per element rather than once per element per stage.
+
+template <typename Source>
+using iterator_of = decltype(std::declval<Source&>().begin());
+template <typename Source>
+using sentinel_of = decltype(std::declval<Source&>().end());
+
+export struct view_sentinel {};
+
+template <typename Source, typename Predicate>
+class filter_view {
+ public:
+  filter_view(Source&& source, Predicate predicate)
+      : source_(std::forward<Source>(source)),
+        predicate_(std::move(predicate)) {}
+
+  class iterator {
+   public:
+    decltype(auto) operator*() const { return *current_; }
+    iterator& operator++() {
+      ++current_;
+      settle();
+      return *this;
+    }
+    friend bool operator!=(const iterator& i, view_sentinel) {
+      return i.current_ != i.end_;
+    }
+
+   private:
+    friend class filter_view;
+    iterator(iterator_of<Source> current, sentinel_of<Source> end,
+             Predicate* predicate)
+        : current_(std::move(current)), end_(end), predicate_(predicate) {
+      settle();
+    }
+
+    void settle() {
+      while (current_ != end_ && !(*predicate_)(*current_)) ++current_;
+    }
+
+    iterator_of<Source> current_;
+    sentinel_of<Source> end_;
+    Predicate* predicate_;
+  };
+
+  iterator begin() {
+    return iterator(source_.begin(), source_.end(), &predicate_);
+  }
+  view_sentinel end() { return {}; }
+
+ private:
+  Source source_;
+  Predicate predicate_;
+};
+
+template <typename Source, typename Function>
+class transform_view {
+ public:
+  transform_view(Source&& source, Function function)
+      : source_(std::forward<Source>(source)),
+        function_(std::move(function)) {}
+
+  class iterator {
+   public:
+    decltype(auto) operator*() const { return (*function_)(*current_); }
+    iterator& operator++() {
+      ++current_;
+      return *this;
+    }
+    friend bool operator!=(const iterator& i, view_sentinel) {
+      return i.current_ != i.end_;
+    }
+
+   private:
+    friend class transform_view;
+    iterator(iterator_of<Source> current, sentinel_of<Source> end,
+             Function* function)
+        : current_(std::move(current)), end_(end), function_(function) {}
+
+    iterator_of<Source> current_;
+    sentinel_of<Source> end_;
+    Function* function_;
+  };
+
+  iterator begin() {
+    return iterator(source_.begin(), source_.end(), &function_);
+  }
+  view_sentinel end() { return {}; }
+
+ private:
+  Source source_;
+  Function function_;
+};
+
+template <typename Source, typename Predicate>
+class take_while_view {
+ public:
+  take_while_view(Source&& source, Predicate predicate)
+      : source_(std::forward<Source>(source)),
+        predicate_(std::move(predicate)) {}
+
+  class iterator {
+   public:
+    decltype(auto) operator*() const { return *current_; }
+    iterator& operator++() {
+      ++current_;
+      return *this;
+    }
+    friend bool operator!=(const iterator& i, view_sentinel) {
+      return i.current_ != i.end_ && (*i.predicate_)(*i.current_);
+    }
+
+   private:
+    friend class take_while_view;
+    iterator(iterator_of<Source> current, sentinel_of<Source> end,
+             Predicate* predicate)
+        : current_(std::move(current)), end_(end), predicate_(predicate) {}
+
+    iterator_of<Source> current_;
+    sentinel_of<Source> end_;
+    Predicate* predicate_;
+  };
+
+  iterator begin() {
+    return iterator(source_.begin(), source_.end(), &predicate_);
+  }
+  view_sentinel end() { return {}; }
+
+ private:
+  Source source_;
+  Predicate predicate_;
+};
+
+// Groups elements into spans of up to `size` elements. Each span is only
+// valid until the iterator is advanced. A contiguous source, such as a
+// vector, is chunked in place. Anything else is copied a chunk at a time into
+// a buffer which is allocated once, when iteration starts.
+template <typename Source, typename Size>
+class chunk_view {
+ public:
+  using value_type =
+      std::remove_cvref_t<decltype(*std::declval<iterator_of<Source>&>())>;
+
+  chunk_view(Source&& source, Size size)
+      : source_(std::forward<Source>(source)), size_(std::max<Size>(size, 1)) {}
+
+  class iterator {
+   public:
+    std::span<const value_type> operator*() const { return chunk_; }
+    iterator& operator++() {
+      fill();
+      return *this;
+    }
+    friend bool operator!=(const iterator& i, view_sentinel) {
+      return !i.chunk_.empty();
+    }
+
+   private:
+    friend class chunk_view;
+    iterator(iterator_of<Source> current, sentinel_of<Source> end, Size size,
+             std::vector<value_type>* buffer)
+        : current_(std::move(current)), end_(end), size_(size),
+          buffer_(buffer) {
+      fill();
+    }
+
+    void fill() {
+      if constexpr (contiguous) {
+        const auto n = std::min<std::size_t>(size_, end_ - current_);
+        chunk_ = std::span<const value_type>(std::to_address(current_), n);
+        current_ += n;
+      } else {
+        buffer_->clear();
+        while (buffer_->size() < size_ && current_ != end_) {
+          buffer_->push_back(*current_);
+          ++current_;
+        }
+        chunk_ = *buffer_;
+      }
+    }
+
+    iterator_of<Source> current_;
+    sentinel_of<Source> end_;
+    Size size_;
+    std::vector<value_type>* buffer_;
+    std::span<const value_type> chunk_;
+  };
+
+  iterator begin() {
+    if constexpr (!contiguous) buffer_.reserve(size_);
+    return iterator(source_.begin(), source_.end(), size_, &buffer_);
+  }
+  view_sentinel end() { return {}; }
+
+ private:
+  static constexpr bool contiguous =
+      std::contiguous_iterator<iterator_of<Source>> &&
+      std::sized_sentinel_for<sentinel_of<Source>, iterator_of<Source>>;
+
+  Source source_;
+  Size size_;
+  // Holds the current chunk when the source isn't contiguous.
+  std::vector<value_type> buffer_;
+};
+
+template <template <typename, typename> typename View, typename Argument>
+struct view_adaptor {
+  Argument argument;
+};
+
+// A source which is an lvalue is referred to, while an rvalue is moved into
+// the pipeline.
+export template <typename Source,
+                 template <typename, typename> typename View,
+                 typename Argument>
+auto operator|(Source&& source, view_adaptor<View, Argument> adaptor) {
+  return View<Source, Argument>(std::forward<Source>(source),
+                                std::move(adaptor.argument));
+}
+
+export template <typename Predicate>
+constexpr auto filter(Predicate predicate) {
+  return view_adaptor<filter_view, Predicate>{std::move(predicate)};
+}
+
+export template <typename Function>
+constexpr auto transform(Function function) {
+  return view_adaptor<transform_view, Function>{std::move(function)};
+}
+
+export template <typename Predicate>
+constexpr auto take_while(Predicate predicate) {
+  return view_adaptor<take_while_view, Predicate>{std::move(predicate)};
+}
+
+export constexpr auto chunk(std::size_t size) {
+  return view_adaptor<chunk_view, std::size_t>{size};
+}
+
+// A bounded multi-producer multi-consumer queue for passing values between
+// coroutines. Sending to a full channel or receiving from an empty one
+// suspends until the operation can complete. Suspended coroutines are
+// resumed on the executor they were suspended on.
+//
+// The buffer is a lock-free ring (Vyukov's bounded MPMC queue), so sends and
+// receives which do not need to wait never take a lock. The lock is only
+// taken to suspend, or to wake a suspended coroutine. A waking coroutine
+// completes the waiter's operation on its behalf, so woken coroutines never
+// need to retry.
+//
+// Buffer slots hold a T at all times, so T must be default constructible and
+// move assignable.
+export template <typename T>
+class channel {
+ public:
+  // The ring needs a power of two number of slots, and at least two, so the
+  // capacity is rounded up to one: channel(3) buffers up to 4 values, and
+  // channel(1) up to 2.
+  explicit channel(std::size_t capacity)
+      : mask_(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+        cells_(new cell[mask_ + 1]) {
+    for (std::size_t i = 0; i <= mask_; i++) cells_[i].sequence.store(i);
+  }
+
+  channel(const channel&) = delete;
+  channel& operator=(const channel&) = delete;
+
+  // Try to send a value without waiting. The value is only moved from if this
+  // succeeds.
+  bool try_send(T& value) {
+    const bool sent = push_open(value);
+    if (sent) wake_receiver();
+    return sent;
+  }
+
+  // Try to receive a value without waiting.
+  std::optional<T> try_receive() {
+    std::optional<T> result;
+    if (pop(result)) wake_sender();
+    return result;
+  }
+
+  // After a channel is closed, sends fail and receives return the remaining
+  // buffered values followed by std::nullopt.
+  void close() {
+    closed_.store(true, std::memory_order_seq_cst);
+    wait_for_sends();
+    std::vector<waiter> woken;
+    {
+      std::lock_guard lock(mutex_);
+      for (auto& w : senders_) {
+        static_cast<send_awaiter*>(w.awaiter)->sent_ = false;
+        woken.push_back(w);
+      }
+      for (auto& w : receivers_) {
+        pop(static_cast<receive_awaiter*>(w.awaiter)->result_);
+        woken.push_back(w);
+      }
+      senders_.clear();
+      receivers_.clear();
+      waiting_senders_.store(0);
+      waiting_receivers_.store(0);
+    }
+    for (auto& w : woken) w.executor->schedule(w.handle);
+  }
+
+  class [[nodiscard]] send_awaiter {
+   public:
+    bool await_ready() {
+      if (channel_.closed_.load(std::memory_order_acquire)) return true;
+      return sent_ = channel_.try_send(value_);
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::unique_lock lock(channel_.mutex_);
+      channel_.senders_.push_back({handle, current_executor, this});
+      channel_.waiting_senders_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // Check again now that any receiver is guaranteed to see us waiting.
+      const bool sent = channel_.push_open(value_);
+      if (!sent && !channel_.closed_.load()) return true;
+      channel_.senders_.pop_back();
+      channel_.waiting_senders_.fetch_sub(1);
+      lock.unlock();
+      if (sent) channel_.wake_receiver();
+      sent_ = sent;
+      return false;
+    }
+
+    // Returns false if the channel was closed.
+    bool await_resume() const { return sent_; }
+
+   private:
+    friend class channel;
+    send_awaiter(channel& channel, T value)
+        : channel_(channel), value_(std::move(value)) {}
+
+    channel& channel_;
+    T value_;
+    bool sent_ = false;
+  };
+
+  class [[nodiscard]] receive_awaiter {
+   public:
+    bool await_ready() {
+      if (channel_.pop(result_)) {
+        channel_.wake_sender();
+        return true;
+      }
+      if (!channel_.closed_.load(std::memory_order_seq_cst)) return false;
+      // Values may have been sent just before the channel was closed.
+      channel_.wait_for_sends();
+      if (channel_.pop(result_)) channel_.wake_sender();
+      return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::unique_lock lock(channel_.mutex_);
+      channel_.receivers_.push_back({handle, current_executor, this});
+      channel_.waiting_receivers_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // Check again now that any sender is guaranteed to see us waiting.
+      if (!channel_.pop(result_) && !channel_.closed_.load()) return true;
+      channel_.receivers_.pop_back();
+      channel_.waiting_receivers_.fetch_sub(1);
+      lock.unlock();
+      if (!result_) {
+        channel_.wait_for_sends();
+        channel_.pop(result_);
+      }
+      if (result_) channel_.wake_sender();
+      return false;
+    }
+
+    // Returns std::nullopt if the channel was closed and is empty.
+    std::optional<T> await_resume() { return std::move(result_); }
+
+   private:
+    friend class channel;
+    explicit receive_awaiter(channel& channel) : channel_(channel) {}
+
+    channel& channel_;
+    std::optional<T> result_;
+  };
+
+  send_awaiter send(T value) { return send_awaiter(*this, std::move(value)); }
+  receive_awaiter receive() { return receive_awaiter(*this); }
+
+ private:
+  struct cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  struct waiter {
+    std::coroutine_handle<> handle;
+    executor* executor;
+    void* awaiter;
+  };
+
+  bool push(T& value) {
+    std::size_t position = enqueue_.load(std::memory_order_relaxed);
+    while (true) {
+      cell& c = cells_[position & mask_];
+      const auto sequence = c.sequence.load(std::memory_order_acquire);
+      const auto difference = (std::ptrdiff_t)(sequence - position);
+      if (difference < 0) return false;  // Full.
+      if (difference > 0) {
+        position = enqueue_.load(std::memory_order_relaxed);
+      } else if (enqueue_.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+        c.value = std::move(value);
+        c.sequence.store(position + 1, std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+  // Push unless the channel is closed. Every send goes through here: close()
+  // waits for pushes which got past the check to finish, so that no value
+  // arrives after a receiver has seen the channel closed and empty.
+  bool push_open(T& value) {
+    sending_.fetch_add(1, std::memory_order_seq_cst);
+    const bool pushed = !closed_.load(std::memory_order_seq_cst) && push(value);
+    sending_.fetch_sub(1, std::memory_order_release);
+    return pushed;
+  }
+
+  void wait_for_sends() const {
+    while (sending_.load(std::memory_order_seq_cst) != 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  bool pop(std::optional<T>& out) {
+    std::size_t position = dequeue_.load(std::memory_order_relaxed);
+    while (true) {
+      cell& c = cells_[position & mask_];
+      const auto sequence = c.sequence.load(std::memory_order_acquire);
+      const auto difference = (std::ptrdiff_t)(sequence - (position + 1));
+      if (difference < 0) return false;  // Empty.
+      if (difference > 0) {
+        position = dequeue_.load(std::memory_order_relaxed);
+      } else if (dequeue_.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+        out.emplace(std::move(c.value));
+        c.sequence.store(position + mask_ + 1, std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+  // Called after freeing up space: complete a waiting send, if there is one.
+  void wake_sender() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_senders_.load(std::memory_order_relaxed) == 0) return;
+    std::unique_lock lock(mutex_);
+    if (senders_.empty()) return;
+    const waiter w = senders_.front();
+    auto* awaiter = static_cast<send_awaiter*>(w.awaiter);
+    const bool sent = push_open(awaiter->value_);
+    // If another sender took the space, this one keeps waiting.
+    if (!sent && !closed_.load()) return;
+    awaiter->sent_ = sent;
+    senders_.pop_front();
+    waiting_senders_.fetch_sub(1);
+    lock.unlock();
+    w.executor->schedule(w.handle);
+    if (sent) wake_receiver();
+  }
+
+  // Called after adding a value: complete a waiting receive, if there is one.
+  void wake_receiver() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_receivers_.load(std::memory_order_relaxed) == 0) return;
+    std::unique_lock lock(mutex_);
+    if (receivers_.empty()) return;
+    const waiter w = receivers_.front();
+    auto* awaiter = static_cast<receive_awaiter*>(w.awaiter);
+    // If another receiver took the value, this one keeps waiting.
+    if (!pop(awaiter->result_)) return;
+    receivers_.pop_front();
+    waiting_receivers_.fetch_sub(1);
+    lock.unlock();
+    w.executor->schedule(w.handle);
+    wake_sender();
+  }
+
+  const std::size_t mask_;
+  const std::unique_ptr<cell[]> cells_;
+  alignas(64) std::atomic<std::size_t> enqueue_ = 0;
+  alignas(64) std::atomic<std::size_t> dequeue_ = 0;
+  alignas(64) std::atomic<int> waiting_senders_ = 0;
+  std::atomic<int> waiting_receivers_ = 0;
+  std::atomic<bool> closed_ = false;
+  // The number of push_open() calls in progress.
+  std::atomic<int> sending_ = 0;
+  std::mutex mutex_;
+  // Suspended coroutines in the order that they arrived. Guarded by mutex_.
+  std::deque<waiter> senders_, receivers_;
+};
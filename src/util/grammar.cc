@@ -0,0 +1,135 @@
+export module util.grammar;
+
+import <charconv>;
+import <string_view>;
+import <tuple>;
+import <type_traits>;
+import util.io;
+
+// A grammar describes a fixed record format as a sequence of parts, eg:
+//
+//   constexpr auto position = grammar(
+//       literal("<x="), field<&vec3i::x>(),
+//       literal(", y="), field<&vec3i::y>(),
+//       literal(", z="), field<&vec3i::z>(), literal(">"));
+//   (scanner >> position(v)).check_ok();
+//
+// Parsing runs as a single pass over the remaining input which only updates
+// the scanner once the whole record has been recognised. If recognition
+// fails, the record is parsed again with the equivalent chain of scanner
+// operations so that the error is reported exactly as it would have been
+// without the grammar.
+
+constexpr void skip_whitespace(const char*& i, const char* end) {
+  while (i != end && is_space(*i)) ++i;
+}
+
+// Matches exact(value).
+export struct literal {
+  constexpr explicit literal(std::string_view value) : value(value) {}
+
+  template <typename Record>
+  constexpr bool match(const char*& i, const char* end, Record&) const {
+    if (value.empty() || !is_space(value.front())) skip_whitespace(i, end);
+    if (!std::string_view(i, end - i).starts_with(value)) return false;
+    i += value.size();
+    return true;
+  }
+
+  template <typename Record>
+  scanner& read(scanner& s, Record&) const {
+    return s >> exact(value);
+  }
+
+  std::string_view value;
+};
+
+// Matches an arithmetic value and stores it in the given member.
+export template <auto member>
+struct field {
+  template <typename Record>
+  bool match(const char*& i, const char* end, Record& out) const {
+    skip_whitespace(i, end);
+    auto [ptr, error] = std::from_chars(i, end, out.*member);
+    if (error != std::errc()) return false;
+    i = ptr;
+    return true;
+  }
+
+  template <typename Record>
+  scanner& read(scanner& s, Record& out) const {
+    return s >> out.*member;
+  }
+};
+
+// Matches sequence<predicate>() and stores the result in the given member.
+export template <auto member, auto predicate>
+struct word {
+  constexpr explicit word(std::string_view name) : name(name) {}
+
+  template <typename Record>
+  bool match(const char*& i, const char* end, Record& out) const {
+    skip_whitespace(i, end);
+    const char* word_end = skip<predicate>(i, end);
+    if (word_end == i) return false;
+    out.*member = std::string_view(i, word_end - i);
+    i = word_end;
+    return true;
+  }
+
+  template <typename Record>
+  scanner& read(scanner& s, Record& out) const {
+    return s >> sequence<predicate>(out.*member, name);
+  }
+
+  std::string_view name;
+};
+
+export template <typename Grammar, typename Record>
+struct grammar_match_type {
+  const Grammar& grammar;
+  Record& out;
+};
+
+export template <typename... Parts>
+class grammar_type {
+ public:
+  constexpr explicit grammar_type(Parts... parts) : parts_(parts...) {}
+
+  template <typename Record>
+  constexpr auto operator()(Record& out) const {
+    return grammar_match_type<grammar_type, Record>{*this, out};
+  }
+
+  template <typename Record>
+  scanner& parse(scanner& s, Record& out) const {
+    if (!s) return s;
+    const auto input = s.remaining();
+    const char* i = input.data();
+    const char* const end = i + input.size();
+    const bool matched = std::apply(
+        [&](const auto&... part) { return (part.match(i, end, out) && ...); },
+        parts_);
+    if (matched) {
+      s.consume(i - input.data());
+      return s;
+    }
+    // Slow path: reparse to produce the usual error message.
+    std::apply([&](const auto&... part) { (part.read(s, out), ...); }, parts_);
+    return s;
+  }
+
+ private:
+  std::tuple<Parts...> parts_;
+};
+
+export template <typename... Parts>
+constexpr auto grammar(Parts... parts) {
+  return grammar_type<Parts...>(parts...);
+}
+
+export template <typename Grammar, typename Record>
+[[nodiscard]] scanner& operator>>(scanner& s,
+                                  grammar_match_type<Grammar, Record> m) {
+  return m.grammar.parse(s, m.out);
+}
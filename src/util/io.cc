@@ -1,7 +1,11 @@
 module;
 
 #include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <immintrin.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -18,6 +22,8 @@ import <stdexcept>;
 import <string>;
 import <string_view>;
 import <sstream>;
+import <thread>;
+import <vector>;
 
 using std::literals::operator""sv;
 
@@ -28,7 +34,8 @@ class contents_error final : public std::runtime_error {
                       std::string(filename) + "\": " + message) {}
 };
 
-// Map the given file into memory. There is no cleanup done by default.
+// Map the given file into memory. There is no cleanup done by default. An
+// empty file can't be mapped, so it gives an empty view.
 export std::string_view contents(const char* filename) {
   int fd = open(filename, O_RDONLY);
   if (fd < 0) throw contents_error(filename, "cannot open file.");
@@ -37,6 +44,10 @@ export std::string_view contents(const char* filename) {
     close(fd);
     throw contents_error(filename, "cannot stat file.");
   }
+  if (info.st_size == 0) {
+    close(fd);
+    return {};
+  }
   const char* data =
       (const char*)mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
   close(fd);  // At this point we don't need the file descriptor any more.
@@ -44,6 +55,172 @@ export std::string_view contents(const char* filename) {
   return std::string_view(data, info.st_size);
 }
 
+// Parsed inputs can be cached in a binary file next to the source. The cache
+// is used if the source has the same size and modification time as when the
+// cache was written, or failing that if the source contents hash to the same
+// value. The payload is an array of trivially copyable values which can be
+// used directly from the mapped file.
+struct cache_header {
+  char magic[8];
+  // Version of this header layout.
+  std::uint32_t format_version;
+  // Version of the parsed representation, as supplied by the caller.
+  std::uint32_t version;
+  std::uint64_t element_size;
+  std::uint64_t count;
+  std::uint64_t source_size;
+  std::int64_t source_mtime;
+  std::uint64_t source_hash;
+  // Checksum of all the fields above.
+  std::uint64_t checksum;
+};
+
+constexpr char cache_magic[8] = {'a', 'o', 'c', 'c', 'a', 'c', 'h', 'e'};
+constexpr std::uint32_t cache_format_version = 1;
+
+// 64-bit FNV-1a.
+std::uint64_t hash(std::string_view data) {
+  std::uint64_t h = 0xcbf29ce484222325;
+  for (unsigned char c : data) h = (h ^ c) * 0x100000001b3;
+  return h;
+}
+
+std::uint64_t checksum(const cache_header& header) {
+  return hash(std::string_view((const char*)&header,
+                               offsetof(cache_header, checksum)));
+}
+
+// Hash a file's contents without leaving it mapped.
+std::uint64_t hash_file(const char* filename) {
+  const auto text = contents(filename);
+  const auto result = hash(text);
+  if (!text.empty()) munmap((void*)text.data(), text.size());
+  return result;
+}
+
+std::int64_t mtime(const struct stat& info) {
+  return info.st_mtim.tv_sec * 1'000'000'000ll + info.st_mtim.tv_nsec;
+}
+
+std::string cache_path(const char* filename) {
+  return std::string(filename) + ".cache";
+}
+
+// Write a cache to a temporary file and rename it into place, so that
+// concurrent readers, which may have the old one mapped, never see a partial
+// or torn cache.
+bool replace_cache(const std::string& path, const cache_header& header,
+                   std::string_view payload) {
+  const auto temp = path + ".tmp";
+  if (std::FILE* file = std::fopen(temp.c_str(), "wb")) {
+    const bool written =
+        std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+        std::fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+    if (std::fclose(file) == 0 && written &&
+        std::rename(temp.c_str(), path.c_str()) == 0) {
+      return true;
+    }
+    std::remove(temp.c_str());
+  }
+  return false;
+}
+
+// Returns the payload of a valid cache for the given source file, if any.
+std::optional<std::string_view> read_cache(const char* filename,
+                                           std::uint32_t version,
+                                           std::size_t element_size) {
+  struct stat source;
+  if (stat(filename, &source) < 0) return std::nullopt;
+  const auto path = cache_path(filename);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return std::nullopt;
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(cache_header)) {
+    close(fd);
+    return std::nullopt;
+  }
+  const char* data =
+      (const char*)mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == (caddr_t)-1) return std::nullopt;
+  cache_header header;
+  std::memcpy(&header, data, sizeof(header));
+  const bool fresh = header.source_mtime == mtime(source);
+  const bool valid =
+      std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0 &&
+      header.checksum == checksum(header) &&
+      header.format_version == cache_format_version &&
+      header.version == version && header.element_size == element_size &&
+      (std::uint64_t)info.st_size ==
+          sizeof(header) + header.count * element_size &&
+      header.source_size == (std::uint64_t)source.st_size &&
+      (fresh || header.source_hash == hash_file(filename));
+  if (!valid) {
+    munmap((void*)data, info.st_size);
+    return std::nullopt;
+  }
+  const auto payload =
+      std::string_view(data + sizeof(header), info.st_size - sizeof(header));
+  if (!fresh) {
+    // The source was touched but not changed. Record the new time so that
+    // later runs can skip hashing it again. Our mapping keeps the old file.
+    header.source_mtime = mtime(source);
+    header.checksum = checksum(header);
+    replace_cache(path, header, payload);
+  }
+  return payload;
+}
+
+// Write a cache for the given source file and return the cached payload. If
+// the cache cannot be written, the payload is copied into memory instead.
+std::string_view write_cache(const char* filename, std::uint32_t version,
+                             std::size_t element_size,
+                             std::string_view payload) {
+  struct stat source;
+  if (stat(filename, &source) < 0) {
+    throw contents_error(filename, "cannot stat file.");
+  }
+  cache_header header = {};
+  std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.format_version = cache_format_version;
+  header.version = version;
+  header.element_size = element_size;
+  header.count = payload.size() / element_size;
+  header.source_size = source.st_size;
+  header.source_mtime = mtime(source);
+  header.source_hash = hash_file(filename);
+  header.checksum = checksum(header);
+  if (replace_cache(cache_path(filename), header, payload)) {
+    if (auto cached = read_cache(filename, version, element_size)) {
+      return *cached;
+    }
+  }
+  char* copy = new char[payload.size()];
+  std::memcpy(copy, payload.data(), payload.size());
+  return std::string_view(copy, payload.size());
+}
+
+// Returns the parsed form of the given file. If there is a valid cache for the
+// file, it is mapped into memory and used directly. Otherwise, the file is
+// parsed with parse(contents) and the result is cached for later runs. The
+// version should be changed whenever the parsed representation changes.
+export template <typename T, typename Parse>
+std::span<const T> cached(const char* filename, std::uint32_t version,
+                          Parse parse) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  static_assert(alignof(T) <= alignof(cache_header));
+  auto payload = read_cache(filename, version, sizeof(T));
+  if (!payload) {
+    const auto values = parse(contents(filename));
+    const std::span<const T> span = values;
+    payload = write_cache(
+        filename, version, sizeof(T),
+        std::string_view((const char*)span.data(), span.size_bytes()));
+  }
+  return std::span<const T>((const T*)payload->data(),
+                            payload->size() / sizeof(T));
+}
+
 export enum whitespace_policy {
   skip_leading_whitespace,
   match_leading_whitespace,
@@ -78,6 +255,95 @@ export constexpr bool is_lower(char c) { return type_map[c] & lower; }
 export constexpr bool is_upper(char c) { return type_map[c] & upper; }
 export constexpr bool is_alnum(char c) { return type_map[c] & (alpha | digit); }
 
+// Vectorized classification for the built-in character classes. Each block
+// of input is classified in a handful of instructions and the result is
+// reduced to a bitmask with one bit per byte.
+#if defined(__AVX2__)
+constexpr int block_size = 32;
+using block = __m256i;
+block load(const char* p) { return _mm256_loadu_si256((const block*)p); }
+block splat(char c) { return _mm256_set1_epi8(c); }
+block equal(block x, char c) { return _mm256_cmpeq_epi8(x, splat(c)); }
+block either(block a, block b) { return _mm256_or_si256(a, b); }
+block unsigned_min(block a, block b) { return _mm256_min_epu8(a, b); }
+block equal(block a, block b) { return _mm256_cmpeq_epi8(a, b); }
+block subtract(block a, block b) { return _mm256_sub_epi8(a, b); }
+unsigned to_mask(block x) { return _mm256_movemask_epi8(x); }
+#elif defined(__SSE2__)
+constexpr int block_size = 16;
+using block = __m128i;
+block load(const char* p) { return _mm_loadu_si128((const block*)p); }
+block splat(char c) { return _mm_set1_epi8(c); }
+block equal(block x, char c) { return _mm_cmpeq_epi8(x, splat(c)); }
+block either(block a, block b) { return _mm_or_si128(a, b); }
+block unsigned_min(block a, block b) { return _mm_min_epu8(a, b); }
+block equal(block a, block b) { return _mm_cmpeq_epi8(a, b); }
+block subtract(block a, block b) { return _mm_sub_epi8(a, b); }
+unsigned to_mask(block x) { return _mm_movemask_epi8(x); }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+constexpr unsigned full_mask =
+    block_size == 32 ? ~0u : (1u << block_size) - 1;
+
+// Bytes in the range [min, max].
+block in_range(block x, char min, char max) {
+  const block offset = subtract(x, splat(min));
+  return equal(unsigned_min(offset, splat(max - min)), offset);
+}
+
+template <unsigned char type>
+block classify(block x) {
+  block result = splat(0);
+  if constexpr ((type & blank) != 0) {
+    result = either(result, either(equal(x, ' '), in_range(x, '\t', '\r')));
+  }
+  if constexpr ((type & alpha) != 0) {
+    result = either(result, in_range(either(x, splat(0x20)), 'a', 'z'));
+  } else if constexpr ((type & lower) != 0) {
+    result = either(result, in_range(x, 'a', 'z'));
+  } else if constexpr ((type & upper) != 0) {
+    result = either(result, in_range(x, 'A', 'Z'));
+  }
+  if constexpr ((type & digit) != 0) {
+    result = either(result, in_range(x, '0', '9'));
+  }
+  return result;
+}
+#endif
+
+// Equivalent to std::find_if_not with a predicate which tests for the given
+// character type.
+template <unsigned char type>
+const char* skip_type(const char* first, const char* last) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  while (last - first >= block_size) {
+    const unsigned mask = to_mask(classify<type>(load(first))) ^ full_mask;
+    if (mask) return first + __builtin_ctz(mask);
+    first += block_size;
+  }
+#endif
+  return std::find_if_not(first, last,
+                          [](char c) { return type_map[c] & type; });
+}
+
+// Equivalent to std::find_if_not(first, last, predicate), but vectorized when
+// the predicate is one of the built-in character classifiers.
+export template <auto predicate>
+const char* skip(const char* first, const char* last) {
+  if constexpr (std::is_same_v<decltype(predicate), bool (*)(char)>) {
+    if constexpr (predicate == is_space) return skip_type<blank>(first, last);
+    if constexpr (predicate == is_alpha) return skip_type<alpha>(first, last);
+    if constexpr (predicate == is_digit) return skip_type<digit>(first, last);
+    if constexpr (predicate == is_lower) return skip_type<lower>(first, last);
+    if constexpr (predicate == is_upper) return skip_type<upper>(first, last);
+    if constexpr (predicate == is_alnum) {
+      return skip_type<alpha | digit>(first, last);
+    }
+  }
+  return std::find_if_not(first, last, predicate);
+}
+
 export class scanner_error : public std::runtime_error {
  public:
   using runtime_error::runtime_error;
@@ -111,32 +377,48 @@ auto sequence(std::string_view& out, std::string_view name,
 
 export struct exact_type {
   std::string_view value;
-  std::string name;
+  // If empty, the value is described as a quoted literal string in errors.
+  std::string_view name;
   whitespace_policy whitespace_policy;
 };
 
-export auto exact(std::string_view text, std::string name) {
-  return exact_type{text, std::move(name),
+export auto exact(std::string_view text, std::string_view name = {}) {
+  return exact_type{text, name,
                     !text.empty() && is_space(text.front())
                         ? match_leading_whitespace
                         : skip_leading_whitespace};
 }
 
-export auto exact(std::string_view text) {
-  std::ostringstream message;
-  message << "literal string " << std::quoted(text);
-  return exact(text, message.str());
-}
-
-export auto exact(std::string_view text, std::string name,
+export auto exact(std::string_view text, std::string_view name,
                   whitespace_policy policy) {
-  return exact_type{text, std::move(name), policy};
+  return exact_type{text, name, policy};
 }
 
 export auto exact(std::string_view text, whitespace_policy policy) {
-  std::ostringstream message;
-  message << "literal string " << std::quoted(text);
-  return exact(text, message.str(), policy);
+  return exact(text, {}, policy);
+}
+
+// Reads a single record with the scanner's own operator>>.
+struct read_record {
+  template <typename Scanner, typename T>
+  Scanner& operator()(Scanner& s, T& out) const { return s >> out; }
+};
+
+export template <typename T, typename Parser>
+struct lines_type {
+  std::vector<T>& out;
+  Parser parse;
+  unsigned num_threads;
+};
+
+// Read records until the end of the input, appending them to out. The input is
+// split at line boundaries into up to num_threads chunks which are parsed
+// concurrently, so each record must end with a newline and must not span
+// multiple lines. Records are appended in input order.
+export template <typename T, typename Parser = read_record>
+auto lines(std::vector<T>& out, Parser parse = {},
+           unsigned num_threads = std::thread::hardware_concurrency()) {
+  return lines_type<T, Parser>{out, std::move(parse), num_threads};
 }
 
 export class scanner {
@@ -148,14 +430,18 @@ export class scanner {
 
   bool ok() const { return !error_; }
   operator bool() const { return ok(); }
+  // Not safe to call concurrently on the same scanner: the message is only
+  // formatted here, into a buffer that the result refers to.
   std::string_view error() const {
-    return error_ ? std::string_view(*error_) : "";
+    if (!error_) return "";
+    error_text_ = format_error(*error_);
+    return error_text_;
   }
   void clear() { error_.reset(); }
 
   void check_ok() const {
     if (!ok()) {
-      std::cerr << *error_ << '\n';
+      std::cerr << error() << '\n';
       std::abort();
     }
   }
@@ -182,9 +468,8 @@ export class scanner {
       return *this;
     }
     if (!source_.starts_with(e.value)) {
-      std::ostringstream message;
-      message << "expected " << e.name << ".";
-      return set_error(message.str());
+      return e.name.empty() ? set_error("expected ", e.value, true, ".")
+                            : set_error("expected ", e.name, false, ".");
     }
     advance(e.value.size());
     return *this;
@@ -201,7 +486,7 @@ export class scanner {
   scanner& operator>>(whitespace_type) {
     if (error_.has_value()) return *this;
     const auto first = source_.data(), last = first + source_.size();
-    const auto word_start = std::find_if_not(first, last, is_space);
+    const auto word_start = skip<is_space>(first, last);
     advance(word_start - first);
     return *this;
   }
@@ -215,7 +500,7 @@ export class scanner {
     source_ = l.source;
     line_ = l.line;
     column_ = l.column;
-    return set_error(l, "expected " + std::string(m.name));
+    return set_error(error_info{l, "expected ", m.name});
   }
 
   template <auto predicate>
@@ -224,9 +509,9 @@ export class scanner {
     if (s.whitespace_policy == skip_leading_whitespace) *this >> whitespace;
     if (source_.empty()) return set_error("unexpected end of input.");
     const auto word_start = source_.data(), last = word_start + source_.size();
-    const auto word_end = std::find_if_not(word_start, last, predicate);
+    const auto word_end = skip<predicate>(word_start, last);
     if (word_start == word_end) {
-      return set_error("expected " + std::string(s.name));
+      return set_error("expected ", s.name);
     }
     s.out = std::string_view(word_start, word_end - word_start);
     advance(word_end - word_start);
@@ -261,6 +546,61 @@ export class scanner {
     return *this;
   }
 
+  template <typename T, typename Parser>
+  [[nodiscard]] scanner& operator>>(lines_type<T, Parser> l) {
+    if (error_.has_value()) return *this;
+    // Small inputs are not worth the cost of starting threads.
+    constexpr std::size_t min_chunk_size = 1 << 16;
+    const std::size_t num_chunks = std::clamp<std::size_t>(
+        source_.size() / min_chunk_size, 1, std::max(l.num_threads, 1u));
+    // Split the input into chunks which each end with a newline. Each chunk
+    // scanner starts at the correct line so that errors are reported relative
+    // to the whole input.
+    std::vector<scanner> chunks;
+    scanner rest = *this;
+    for (std::size_t i = num_chunks; i > 1; i--) {
+      const auto split = rest.source_.find('\n', rest.source_.size() / i);
+      if (split == std::string_view::npos) break;
+      chunks.push_back(rest);
+      chunks.back().source_ = rest.source_.substr(0, split + 1);
+      rest.advance(split + 1);
+    }
+    chunks.push_back(rest);
+
+    std::vector<std::vector<T>> results(chunks.size());
+    auto parse_chunk = [&](std::size_t i) {
+      scanner& chunk = chunks[i];
+      while (!chunk.done()) {
+        T value;
+        if (!l.parse(chunk, value)) return;
+        results[i].push_back(std::move(value));
+      }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < chunks.size(); i++) {
+      workers.emplace_back(parse_chunk, i);
+    }
+    parse_chunk(0);
+    for (auto& worker : workers) worker.join();
+
+    // Stop at the earliest failing chunk, or at the end of the last one.
+    const auto failed = std::find_if(std::begin(chunks), std::end(chunks),
+                                     [](const scanner& s) { return !s.ok(); });
+    const auto last = failed == std::end(chunks) ? failed - 1 : failed;
+    for (auto i = std::begin(chunks); i != last + 1; ++i) {
+      auto& result = results[i - std::begin(chunks)];
+      std::move(std::begin(result), std::end(result),
+                std::back_inserter(l.out));
+    }
+    const auto end = source_.data() + source_.size();
+    source_ = std::string_view(last->source_.data(),
+                               end - last->source_.data());
+    line_ = last->line_;
+    column_ = last->column_;
+    error_ = std::move(last->error_);
+    return *this;
+  }
+
   [[nodiscard]] scanner& operator>>(end_type) {
     if (error_.has_value()) return *this;
     *this >> whitespace;
@@ -272,13 +612,13 @@ export class scanner {
 
   bool done() const {
     const auto first = source_.data(), last = first + source_.size();
-    return std::find_if_not(first, last, is_space) == last;
+    return skip<is_space>(first, last) == last;
   }
 
   std::string_view remaining() const { return source_; }
   std::string_view consume(std::size_t amount) {
     auto result = source_.substr(0, amount);
-    source_.remove_prefix(result.size());
+    advance(result.size());
     return result;
   }
 
@@ -293,18 +633,33 @@ export class scanner {
 
   void advance(std::size_t amount) {
     assert(amount <= source_.length());
-    for (char c : source_.substr(0, amount)) {
-      if (c == '\n') {
-        line_++;
-        column_ = 1;
-      } else {
-        column_++;
-      }
+    const auto text = source_.substr(0, amount);
+    if (const auto last_newline = text.rfind('\n');
+        last_newline != std::string_view::npos) {
+      line_ += std::count(std::begin(text), std::end(text), '\n');
+      column_ = amount - last_newline;
+    } else {
+      column_ += amount;
     }
     source_.remove_prefix(amount);
   }
 
-  scanner& set_error(location l, std::string_view message) {
+  // Errors are recorded in this form so that parsers which backtrack by
+  // calling clear() never pay for formatting a message they will discard, or
+  // for copying anything. message and suffix are always literals, and name
+  // is the caller's exact() text or match() name, so those must outlive any
+  // call to error().
+  struct error_info {
+    location where;
+    std::string_view message;
+    // Description of what was expected, if any, and what follows it.
+    std::string_view name = {};
+    bool quote_name = false;
+    std::string_view suffix = {};
+  };
+
+  static std::string format_error(const error_info& e) {
+    const auto& l = e.where;
     const int index = l.column - 1;
     const auto line_start = l.source.data() - index;
     const auto line_end =
@@ -312,7 +667,13 @@ export class scanner {
     const auto line_contents =
         std::string_view(line_start, line_end - line_start);
     std::ostringstream output;
-    output << l.line << ':' << l.column << ": " << message << "\n";
+    output << l.line << ':' << l.column << ": " << e.message;
+    if (e.quote_name) {
+      output << "literal string " << std::quoted(e.name);
+    } else {
+      output << e.name;
+    }
+    output << e.suffix << "\n";
     constexpr int line_length = 80, indent = 4;
     constexpr int midpoint = (line_length - indent) / 2;
     if (line_contents.size() <= line_length - indent) {
@@ -340,23 +701,36 @@ export class scanner {
              << "...\n"
              << std::string(indent + midpoint, ' ') << "^\n";
     }
-    error_ = output.str();
+    return output.str();
+  }
+
+  scanner& set_error(error_info e) {
+    error_ = e;
     return *this;
   }
 
-  scanner& set_error(std::string_view message) {
-    return set_error(location{source_, line_, column_}, message);
+  scanner& set_error(std::string_view message, std::string_view name = {},
+                     bool quote_name = false, std::string_view suffix = {}) {
+    return set_error(error_info{location{source_, line_, column_}, message,
+                                name, quote_name, suffix});
   }
 
-  std::optional<std::string> error_;
+  std::optional<error_info> error_;
+  // Rendered form of error_, populated on demand by error().
+  mutable std::string error_text_;
   std::string_view source_;
   int line_ = 1, column_ = 1;
 };
 
-export std::string_view init(int argc, char* argv[]) {
+// Returns the input filename, or exits with a usage message.
+export const char* input_filename(int argc, char* argv[]) {
   if (argc != 2) {
     std::cerr << "Usage: " << argv[0] << " <filename>\n";
     std::exit(1);
   }
-  return contents(argv[1]);
+  return argv[1];
+}
+
+export std::string_view init(int argc, char* argv[]) {
+  return contents(input_filename(argc, argv));
 }